@@ -0,0 +1,401 @@
+/*
+ * libusbd480, drawing on USBD480 panels from userspace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <linux/fb.h>
+
+#include "libusbd480.h"
+
+struct usbd480_panel {
+	int fd;
+	uint16_t *mem;
+	size_t memsize;
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	unsigned int frames;	/* 2 when double buffered */
+	unsigned int shown;	/* frame panned to */
+	struct fb_var_screeninfo var;
+	const volatile struct usbd480_stats *stats;
+	uint64_t pace_next;	/* ns, 0 until the first usbd480_pace() */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the driver's stats page, the fb device's parent is the interface */
+static void map_stats(struct usbd480_panel *u)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	void *p;
+	int fd;
+
+	if (fstat(u->fd, &sb) < 0)
+		return;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/stats",
+		major(sb.st_rdev), minor(sb.st_rdev));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	p = mmap(NULL, sizeof(struct usbd480_stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+	u->stats = p;
+	if (u->stats->version != USBD480_STATS_VERSION) {
+		munmap(p, sizeof(struct usbd480_stats));
+		u->stats = NULL;
+	}
+}
+
+struct usbd480_panel *usbd480_open(const char *fbdev)
+{
+	struct fb_fix_screeninfo fix;
+	struct usbd480_panel *u;
+	int err;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+
+	u->fd = open(fbdev, O_RDWR | O_CLOEXEC);
+	if (u->fd < 0)
+		goto error;
+	if (ioctl(u->fd, FBIOGET_VSCREENINFO, &u->var) < 0 ||
+	    ioctl(u->fd, FBIOGET_FSCREENINFO, &fix) < 0)
+		goto error_fd;
+	if (u->var.bits_per_pixel != 16) {
+		errno = ENOTSUP;
+		goto error_fd;
+	}
+
+	u->width = u->var.xres;
+	u->height = u->var.yres;
+	u->stride = fix.line_length / 2;
+	/* older drivers have a single frame */
+	u->frames = u->var.yres_virtual >= 2 * u->var.yres ? 2 : 1;
+	u->shown = u->var.yoffset ? 1 : 0;
+	u->memsize = (size_t)fix.line_length * u->height * u->frames;
+	u->mem = mmap(NULL, u->memsize, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, 0);
+	if (u->mem == MAP_FAILED)
+		goto error_fd;
+
+	map_stats(u);
+	return u;
+
+error_fd:
+	err = errno;
+	close(u->fd);
+	errno = err;
+error:
+	free(u);
+	return NULL;
+}
+
+void usbd480_close(struct usbd480_panel *u)
+{
+	if (!u)
+		return;
+	if (u->stats)
+		munmap((void *)u->stats, sizeof(struct usbd480_stats));
+	munmap(u->mem, u->memsize);
+	close(u->fd);
+	free(u);
+}
+
+unsigned int usbd480_width(const struct usbd480_panel *u)
+{
+	return u->width;
+}
+
+unsigned int usbd480_height(const struct usbd480_panel *u)
+{
+	return u->height;
+}
+
+unsigned int usbd480_stride(const struct usbd480_panel *u)
+{
+	return u->stride;
+}
+
+int usbd480_fd(const struct usbd480_panel *u)
+{
+	return u->fd;
+}
+
+int usbd480_double_buffered(const struct usbd480_panel *u)
+{
+	return u->frames == 2;
+}
+
+static uint16_t *frame(struct usbd480_panel *u, unsigned int n)
+{
+	return u->mem + (size_t)n * u->height * u->stride;
+}
+
+uint16_t *usbd480_buffer(struct usbd480_panel *u)
+{
+	return frame(u, u->frames == 2 ? !u->shown : 0);
+}
+
+int usbd480_damage(struct usbd480_panel *u, unsigned int y, unsigned int h)
+{
+	struct usbd480_damage dmg = { .y = y, .h = h };
+
+	return ioctl(u->fd, IOCTL_DAMAGE, &dmg) < 0 ? -1 : 0;
+}
+
+int usbd480_flip(struct usbd480_panel *u, unsigned int flags)
+{
+	unsigned int next = !u->shown;
+
+	if (u->frames == 1)
+		return usbd480_damage(u, 0, u->height);
+
+	u->var.xoffset = 0;
+	u->var.yoffset = next * u->height;
+	if (ioctl(u->fd, FBIOPAN_DISPLAY, &u->var) < 0)
+		return -1;
+	u->shown = next;
+
+	if (flags & USBD480_FLIP_PRESERVE)
+		memcpy(usbd480_buffer(u), frame(u, u->shown),
+			(size_t)u->height * u->stride * 2);
+	return 0;
+}
+
+int usbd480_wait(struct usbd480_panel *u)
+{
+	uint32_t crtc = 0;
+
+	return ioctl(u->fd, FBIO_WAITFORVSYNC, &crtc) < 0 ? -1 : 0;
+}
+
+int usbd480_pace(struct usbd480_panel *u, unsigned int fps)
+{
+	uint64_t period, now;
+	struct timespec ts;
+	int missed = 0;
+
+	if (!fps) {
+		errno = EINVAL;
+		return -1;
+	}
+	period = 1000000000ull / fps;
+	now = now_ns();
+	if (!u->pace_next)
+		u->pace_next = now;
+	u->pace_next += period;
+
+	if (u->pace_next <= now) {
+		missed = (now - u->pace_next) / period + 1;
+		u->pace_next += (uint64_t)missed * period;
+	}
+
+	ts.tv_sec = u->pace_next / 1000000000;
+	ts.tv_nsec = u->pace_next % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	return missed;
+}
+
+/* see usbd480fb.h for the seq protocol */
+int usbd480_get_stats(struct usbd480_panel *u, struct usbd480_stats *st)
+{
+	const volatile struct usbd480_stats *p = u->stats;
+	uint32_t seq;
+
+	if (!p) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	do {
+		while ((seq = p->seq) & 1)
+			;
+		__sync_synchronize();
+		memcpy(st, (const void *)p, sizeof(*st));
+		__sync_synchronize();
+	} while (p->seq != seq);
+	return 0;
+}
+
+int usbd480_brightness(struct usbd480_panel *u, unsigned int level)
+{
+	char path[PATH_MAX], val[8];
+	struct stat sb;
+	int fd, len, ret;
+
+	if (level > 255) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fstat(u->fd, &sb) < 0)
+		return -1;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/brightness",
+		major(sb.st_rdev), minor(sb.st_rdev));
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = snprintf(val, sizeof(val), "%u\n", level);
+	ret = write(fd, val, len) == len ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+void usbd480_batch_init(struct usbd480_batch *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void usbd480_batch_free(struct usbd480_batch *b)
+{
+	free(b->buf);
+	usbd480_batch_init(b);
+}
+
+/* room for len more bytes, zeroed */
+static void *batch_add(struct usbd480_batch *b, size_t len)
+{
+	void *p;
+
+	if (b->len + len > b->size) {
+		size_t size = b->size ? b->size : 4096;
+
+		while (size < b->len + len)
+			size *= 2;
+		p = realloc(b->buf, size);
+		if (!p)
+			return NULL;
+		b->buf = p;
+		b->size = size;
+	}
+	p = b->buf + b->len;
+	memset(p, 0, len);
+	b->len += len;
+	return p;
+}
+
+static int batch_cmd(struct usbd480_batch *b, unsigned int op, unsigned int page,
+		uint32_t value)
+{
+	struct usbd480_cmd *cmd = batch_add(b, sizeof(*cmd));
+
+	if (!cmd)
+		return -1;
+	cmd->op = op;
+	cmd->page = page;
+	cmd->value = value;
+	return 0;
+}
+
+int usbd480_batch_blit(struct usbd480_batch *b, unsigned int page, unsigned int x,
+		unsigned int y, unsigned int w, unsigned int h,
+		const uint16_t *pixels, unsigned int stride)
+{
+	size_t payload = ((size_t)w * h * 2 + 3) & ~(size_t)3;
+	struct usbd480_cmd *cmd;
+	uint16_t *dst;
+	unsigned int j;
+
+	if (page >= USBD480_DIRECT_PAGES || w > 0xffff || h > 0xffff) {
+		errno = EINVAL;
+		return -1;
+	}
+	cmd = batch_add(b, sizeof(*cmd) + payload);
+	if (!cmd)
+		return -1;
+	cmd->op = USBD480_CMD_BLIT;
+	cmd->page = page;
+	cmd->x = x;
+	cmd->y = y;
+	cmd->w = w;
+	cmd->h = h;
+
+	dst = (uint16_t *)(cmd + 1);
+	for (j = 0; j < h; j++)
+		memcpy(dst + (size_t)j * w, pixels + (size_t)j * stride, w * 2);
+	return 0;
+}
+
+int usbd480_batch_flip(struct usbd480_batch *b, unsigned int page)
+{
+	return batch_cmd(b, USBD480_CMD_FLIP, page, 0);
+}
+
+int usbd480_batch_brightness(struct usbd480_batch *b, unsigned int level)
+{
+	return batch_cmd(b, USBD480_CMD_BRIGHTNESS, 0, level);
+}
+
+int usbd480_batch_fence(struct usbd480_batch *b, uint32_t id)
+{
+	return batch_cmd(b, USBD480_CMD_FENCE, 0, id);
+}
+
+/* the driver takes whole commands only, a short write is carried on */
+int usbd480_batch_submit(int fd, struct usbd480_batch *b)
+{
+	size_t pos = 0;
+	ssize_t n;
+
+	while (pos < b->len) {
+		n = write(fd, b->buf + pos, b->len - pos);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* keep what was not taken for another try */
+			memmove(b->buf, b->buf + pos, b->len - pos);
+			b->len -= pos;
+			return -1;
+		}
+		pos += n;
+	}
+	b->len = 0;
+	return 0;
+}
+
+int usbd480_direct_wait(int fd, uint32_t id, int *status)
+{
+	struct usbd480_completion c[16];
+	ssize_t n;
+	int i;
+
+	for (;;) {
+		n = read(fd, c, sizeof(c));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (i = 0; i < n / (ssize_t)sizeof(c[0]); i++)
+			if (c[i].id == id) {
+				*status = c[i].status;
+				return 0;
+			}
+	}
+}
@@ -0,0 +1,116 @@
+/*
+ * libusbd480, drawing on USBD480 panels from userspace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ Two ways to a panel:
+
+ The framebuffer, /dev/fbN. usbd480_open() maps both frames of it. Draw
+ into usbd480_buffer() and either report what changed with
+ usbd480_damage() or show the whole buffer with usbd480_flip(). The
+ driver's stats page is found through sysfs when it is there.
+
+   struct usbd480_panel *u = usbd480_open("/dev/fb1");
+   for (;;) {
+	draw(usbd480_buffer(u), usbd480_stride(u));
+	usbd480_flip(u, 0);
+	usbd480_pace(u, 30);
+   }
+
+ The character device, /dev/usbd480-N, which takes batches of commands,
+ see usbd480fb.h. The usbd480_batch_* calls build a batch and submit it.
+
+ Calls returning int return 0 or more on success and -1 with errno set
+ on failure.
+*/
+
+#ifndef _LIBUSBD480_H
+#define _LIBUSBD480_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbd480fb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct usbd480_panel;
+
+#define USBD480_FLIP_PRESERVE	1	/* the next buffer starts as a copy of the shown one */
+
+struct usbd480_panel *usbd480_open(const char *fbdev);
+void usbd480_close(struct usbd480_panel *u);
+
+unsigned int usbd480_width(const struct usbd480_panel *u);
+unsigned int usbd480_height(const struct usbd480_panel *u);
+unsigned int usbd480_stride(const struct usbd480_panel *u);	/* pixels per row */
+int usbd480_fd(const struct usbd480_panel *u);
+
+/*
+ * The frame to draw into. With double buffering it is not shown until
+ * the next usbd480_flip(), without it is the one on screen.
+ */
+uint16_t *usbd480_buffer(struct usbd480_panel *u);
+int usbd480_double_buffered(const struct usbd480_panel *u);
+
+/* rows y to y + h - 1 of the shown frame changed, send them now */
+int usbd480_damage(struct usbd480_panel *u, unsigned int y, unsigned int h);
+
+/* show the buffer, returns once the driver has it */
+int usbd480_flip(struct usbd480_panel *u, unsigned int flags);
+
+/* wait until everything drawn so far is on the panel */
+int usbd480_wait(struct usbd480_panel *u);
+
+/*
+ * Sleep until the next frame at fps frames per second, counted from the
+ * first call. Returns the number of frame slots missed since the last
+ * call, which are skipped rather than caught up with.
+ */
+int usbd480_pace(struct usbd480_panel *u, unsigned int fps);
+
+/* consistent copy of the driver's stats, ENOTSUP without the stats page */
+int usbd480_get_stats(struct usbd480_panel *u, struct usbd480_stats *st);
+
+/* set the backlight, 0-255 */
+int usbd480_brightness(struct usbd480_panel *u, unsigned int level);
+
+/*
+ * Command batches for the character device. A batch grows as needed,
+ * usbd480_batch_submit() writes all of it and empties it.
+ */
+struct usbd480_batch {
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+void usbd480_batch_init(struct usbd480_batch *b);
+void usbd480_batch_free(struct usbd480_batch *b);
+int usbd480_batch_blit(struct usbd480_batch *b, unsigned int page, unsigned int x,
+		unsigned int y, unsigned int w, unsigned int h,
+		const uint16_t *pixels, unsigned int stride);
+int usbd480_batch_flip(struct usbd480_batch *b, unsigned int page);
+int usbd480_batch_brightness(struct usbd480_batch *b, unsigned int level);
+int usbd480_batch_fence(struct usbd480_batch *b, uint32_t id);
+int usbd480_batch_submit(int fd, struct usbd480_batch *b);
+
+/*
+ * Read completions of queued submissions from the character device until
+ * the one with id turns up, others read on the way are dropped. Its
+ * status, 0 or a negative errno, is stored in status.
+ */
+int usbd480_direct_wait(int fd, uint32_t id, int *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * libusbd480, C++ wrapper
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ Owns the panel and the batch for their lifetime, failures throw
+ std::system_error:
+
+   usbd480::Panel panel("/dev/fb1");
+   for (;;) {
+	draw(panel.buffer(), panel.stride());
+	panel.flip();
+	panel.pace(30);
+   }
+*/
+
+#ifndef _USBD480_HPP
+#define _USBD480_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libusbd480.h"
+
+namespace usbd480 {
+
+inline void check(int ret, const char *what)
+{
+	if (ret < 0)
+		throw std::system_error(errno, std::generic_category(), what);
+}
+
+class Panel {
+public:
+	explicit Panel(const std::string &fbdev)
+		: u_(usbd480_open(fbdev.c_str()))
+	{
+		if (!u_)
+			throw std::system_error(errno, std::generic_category(), fbdev);
+	}
+	~Panel() { usbd480_close(u_); }
+
+	Panel(const Panel &) = delete;
+	Panel &operator=(const Panel &) = delete;
+	Panel(Panel &&o) noexcept : u_(std::exchange(o.u_, nullptr)) {}
+	Panel &operator=(Panel &&o) noexcept
+	{
+		std::swap(u_, o.u_);
+		return *this;
+	}
+
+	unsigned int width() const { return usbd480_width(u_); }
+	unsigned int height() const { return usbd480_height(u_); }
+	unsigned int stride() const { return usbd480_stride(u_); }
+	bool double_buffered() const { return usbd480_double_buffered(u_); }
+	uint16_t *buffer() { return usbd480_buffer(u_); }
+
+	void damage(unsigned int y, unsigned int h) { check(usbd480_damage(u_, y, h), "damage"); }
+	void flip(unsigned int flags = 0) { check(usbd480_flip(u_, flags), "flip"); }
+	void wait() { check(usbd480_wait(u_), "wait"); }
+	int pace(unsigned int fps)
+	{
+		int missed = usbd480_pace(u_, fps);
+
+		check(missed, "pace");
+		return missed;
+	}
+	void brightness(unsigned int level) { check(usbd480_brightness(u_, level), "brightness"); }
+
+	/* false without the stats page */
+	bool stats(struct usbd480_stats &st) { return usbd480_get_stats(u_, &st) == 0; }
+
+	struct usbd480_panel *get() { return u_; }
+
+private:
+	struct usbd480_panel *u_;
+};
+
+/* the character device with a batch being built for it */
+class Direct {
+public:
+	explicit Direct(const std::string &path, int flags = 0)
+		: fd_(::open(path.c_str(), O_RDWR | O_CLOEXEC | flags))
+	{
+		if (fd_ < 0)
+			throw std::system_error(errno, std::generic_category(), path);
+		usbd480_batch_init(&batch_);
+	}
+	~Direct()
+	{
+		usbd480_batch_free(&batch_);
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	Direct(const Direct &) = delete;
+	Direct &operator=(const Direct &) = delete;
+
+	void blit(unsigned int page, unsigned int x, unsigned int y, unsigned int w,
+		unsigned int h, const uint16_t *pixels, unsigned int stride)
+	{
+		check(usbd480_batch_blit(&batch_, page, x, y, w, h, pixels, stride), "blit");
+	}
+	void flip(unsigned int page) { check(usbd480_batch_flip(&batch_, page), "flip"); }
+	void brightness(unsigned int level)
+	{
+		check(usbd480_batch_brightness(&batch_, level), "brightness");
+	}
+	void fence(uint32_t id) { check(usbd480_batch_fence(&batch_, id), "fence"); }
+	void submit() { check(usbd480_batch_submit(fd_, &batch_), "submit"); }
+
+	/* status of the queued submission id, 0 or a negative errno */
+	int wait(uint32_t id)
+	{
+		int status;
+
+		check(usbd480_direct_wait(fd_, id, &status), "wait");
+		return status;
+	}
+
+	int fd() const { return fd_; }
+
+private:
+	int fd_;
+	usbd480_batch batch_;
+};
+
+}
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * USBD480 framebuffer benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ Draws a synthetic workload into a framebuffer and measures what the
+ driver makes of it:
+
+   usbd480-bench -f /dev/fb1 -s /sys/bus/usb/devices/1-1:1.0/stats -w scroll -t 10
+
+ Workloads:
+   video	every pixel changes each frame
+   widgets	-n rectangles of -W pixels, at -r fps divided by 1, 2, 3, 5,
+		8, 13, 30 and 60 in turn
+   scroll	a text console scrolling one line per frame
+   cursor	a 16x16 cursor moving across the screen
+   idle		nothing changes
+
+ Drawing goes to the frame on screen, following the pan offset.
+
+ With the stats page (-s) it reports the frame rate the panel achieved,
+ the latency from drawing to the frame being on screen, the time the
+ driver spent sending and the bytes per second on the bus. The latency
+ of a draw is taken at the first flip whose damage scan started after
+ the draw, which is the first frame that carries all of it. System CPU time is taken from /proc/stat
+ since the driver's work runs in shared kernel threads.
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/fb.h>
+
+#include "usbd480fb.h"
+
+#define BENCH_MAX_SAMPLES 100000
+#define BENCH_LINE 16		/* text line height for scroll */
+#define BENCH_CURSOR 16
+
+/* widget i is redrawn every bench_widget_div[i % 8]th frame */
+static const unsigned int bench_widget_div[] = { 1, 2, 3, 5, 8, 13, 30, 60 };
+
+struct fb {
+	int fd;
+	uint16_t *mem;		/* the frame on screen */
+	uint16_t *map;
+	unsigned int width;
+	unsigned int height;
+	unsigned int yres_virtual;
+	unsigned int stride;	/* pixels per row */
+};
+
+struct bench {
+	struct fb fb;
+	const char *workload;
+	unsigned int rate;
+	unsigned int widgets;
+	unsigned int widget_size;
+	unsigned int frame;
+	const volatile struct usbd480_stats *stats;
+	uint32_t lat_us[BENCH_MAX_SAMPLES];
+	unsigned int lat_count;
+	unsigned int coalesced;	/* draws replaced before they reached the panel */
+};
+
+static volatile sig_atomic_t bench_quit;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	bench_quit = 1;
+}
+
+/* consistent copy of the stats page, see usbd480fb.h */
+static void stats_snapshot(const volatile struct usbd480_stats *p, struct usbd480_stats *st)
+{
+	uint32_t seq;
+
+	do {
+		while ((seq = p->seq) & 1)
+			;
+		__sync_synchronize();
+		memcpy(st, (const void *)p, sizeof(*st));
+		__sync_synchronize();
+	} while (p->seq != seq);
+}
+
+static void fb_open(struct fb *fb, const char *path)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	fb->fd = open(path, O_RDWR);
+	if (fb->fd < 0)
+		die(path);
+	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) < 0 ||
+	    ioctl(fb->fd, FBIOGET_FSCREENINFO, &fix) < 0)
+		die("FBIOGET_*SCREENINFO");
+	if (var.bits_per_pixel != 16) {
+		fprintf(stderr, "%s: %u bpp, only 16 is supported\n", path, var.bits_per_pixel);
+		exit(1);
+	}
+
+	fb->width = var.xres;
+	fb->height = var.yres;
+	fb->yres_virtual = var.yres_virtual < var.yres ? var.yres : var.yres_virtual;
+	fb->stride = fix.line_length / 2;
+	fb->map = mmap(NULL, (size_t)fix.line_length * fb->yres_virtual,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+	if (fb->map == MAP_FAILED)
+		die("mmap framebuffer");
+	fb->mem = fb->map;
+}
+
+/* a panning client may have moved the frame on screen */
+static void fb_follow(struct fb *fb)
+{
+	struct fb_var_screeninfo var;
+
+	if (!ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) &&
+	    var.yoffset + fb->height <= fb->yres_virtual)
+		fb->mem = fb->map + (size_t)var.yoffset * fb->stride;
+}
+
+static void fill_rect(struct fb *fb, unsigned int x, unsigned int y, unsigned int w,
+		unsigned int h, uint16_t color)
+{
+	unsigned int i, j;
+
+	if (x >= fb->width || y >= fb->height)
+		return;
+	if (x + w > fb->width)
+		w = fb->width - x;
+	if (y + h > fb->height)
+		h = fb->height - y;
+
+	for (j = 0; j < h; j++) {
+		uint16_t *row = fb->mem + (y + j) * fb->stride + x;
+
+		for (i = 0; i < w; i++)
+			row[i] = color;
+	}
+}
+
+/* returns nonzero when something was drawn */
+static int draw(struct bench *b)
+{
+	struct fb *fb = &b->fb;
+	unsigned int f = b->frame++;
+	unsigned int i, x, y;
+
+	if (!strcmp(b->workload, "video")) {
+		for (y = 0; y < fb->height; y++) {
+			uint16_t *row = fb->mem + y * fb->stride;
+
+			for (x = 0; x < fb->width; x++)
+				row[x] = (x + y + f * 7) * 0x0841;
+		}
+		return 1;
+	}
+
+	if (!strcmp(b->workload, "widgets")) {
+		unsigned int per_row = fb->width / b->widget_size;
+		int drawn = 0;
+
+		if (!per_row)
+			per_row = 1;
+		for (i = 0; i < b->widgets; i++) {
+			unsigned int div = bench_widget_div[i % 8];
+
+			if (f % div)
+				continue;
+			x = (i % per_row) * b->widget_size;
+			y = (i / per_row) * b->widget_size;
+			fill_rect(fb, x, y, b->widget_size - 1, b->widget_size - 1,
+				(f / div + i) * 0x1863);
+			drawn = 1;
+		}
+		return drawn;
+	}
+
+	if (!strcmp(b->workload, "scroll")) {
+		unsigned int rows = fb->height - BENCH_LINE;
+
+		memmove(fb->mem, fb->mem + BENCH_LINE * fb->stride,
+			(size_t)rows * fb->stride * 2);
+		fill_rect(fb, 0, rows, fb->width, BENCH_LINE, 0);
+		/* a line of "text" of varying length */
+		for (x = 0; x < (f * 37) % fb->width; x += 8)
+			fill_rect(fb, x + 1, rows + 3, 6, BENCH_LINE - 6, 0xffff);
+		return 1;
+	}
+
+	if (!strcmp(b->workload, "cursor")) {
+		static unsigned int cx, cy;
+
+		fill_rect(fb, cx, cy, BENCH_CURSOR, BENCH_CURSOR, 0);
+		cx = (f * 5) % (fb->width - BENCH_CURSOR);
+		cy = (f * 3) % (fb->height - BENCH_CURSOR);
+		fill_rect(fb, cx, cy, BENCH_CURSOR, BENCH_CURSOR, 0xffff);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(struct bench *b, int pct)
+{
+	if (!b->lat_count)
+		return 0;
+	return b->lat_us[(b->lat_count - 1) * pct / 100];
+}
+
+/* busy and total jiffies of all cpus */
+static void cpu_times(uint64_t *sys, uint64_t *total)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+	int i;
+
+	*sys = *total = 0;
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+		/* system, irq and softirq */
+		*sys = v[2] + v[5] + v[6];
+		for (i = 0; i < 8; i++)
+			*total += v[i];
+	}
+	fclose(f);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -f /dev/fbN [-s stats] [-w workload] [-t seconds] [-r fps]\n"
+		"          [-n widgets] [-W size]\n"
+		"  workloads: video scroll widgets cursor idle (video)\n"
+		"  defaults: 10 s at 60 fps, 8 widgets of 32 pixels\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *fbpath = NULL, *stats_path = NULL;
+	struct usbd480_stats st0, st1;
+	struct bench *b;
+	struct sigaction sa;
+	uint64_t start, next, end, sys0, sys1, tot0, tot1, elapsed;
+	unsigned int seconds = 10, draws = 0;
+	int opt;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		die("calloc");
+	b->workload = "video";
+	b->rate = 60;
+	b->widgets = 8;
+	b->widget_size = 32;
+
+	while ((opt = getopt(argc, argv, "f:s:w:t:r:n:W:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fbpath = optarg;
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 'w':
+			b->workload = optarg;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			b->rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b->widgets = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			b->widget_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!fbpath || !b->rate || b->widget_size < 2 || !seconds)
+		usage(argv[0]);
+	if (strcmp(b->workload, "video") && strcmp(b->workload, "widgets") &&
+	    strcmp(b->workload, "scroll") && strcmp(b->workload, "cursor") &&
+	    strcmp(b->workload, "idle"))
+		usage(argv[0]);
+
+	fb_open(&b->fb, fbpath);
+
+	if (stats_path) {
+		int fd = open(stats_path, O_RDONLY);
+		void *p;
+
+		if (fd < 0)
+			die(stats_path);
+		p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			die("mmap stats");
+		b->stats = p;
+		if (b->stats->version != USBD480_STATS_VERSION) {
+			fprintf(stderr, "stats page version %u, expected %u\n",
+				b->stats->version, USBD480_STATS_VERSION);
+			return 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (b->stats)
+		stats_snapshot(b->stats, &st0);
+	cpu_times(&sys0, &tot0);
+
+	start = now_ns();
+	next = start;
+	end = start + seconds * 1000000000ULL;
+
+	while (!bench_quit && next < end) {
+		uint64_t drawn, deadline;
+		int did, seen = 0;
+
+		fb_follow(&b->fb);
+		did = draw(b);
+		if (did)
+			draws++;
+		drawn = now_ns();
+		next += 1000000000ULL / b->rate;
+
+		/*
+		 * Wait for the first flip of a frame whose damage scan started
+		 * after the draw. A flip already under way may have been
+		 * scanned before it and not carry it. A draw still not shown
+		 * when the next one is due gets merged into that one by the
+		 * driver.
+		 */
+		deadline = next;
+		while (b->stats && did && now_ns() < deadline) {
+			struct usbd480_stats st;
+
+			stats_snapshot(b->stats, &st);
+			if (st.last_scan_ns >= drawn) {
+				if (b->lat_count < BENCH_MAX_SAMPLES)
+					b->lat_us[b->lat_count++] = (st.last_flip_ns - drawn) / 1000;
+				seen = 1;
+				break;
+			}
+			usleep(200);
+		}
+		if (b->stats && did && !seen)
+			b->coalesced++;
+
+		sleep_until(next);
+	}
+
+	elapsed = now_ns() - start;
+	cpu_times(&sys1, &tot1);
+
+	printf("%s: %u draws in %.2f s (%.1f/s)\n", b->workload, draws, elapsed / 1e9,
+		draws * 1e9 / elapsed);
+	if (tot1 > tot0)
+		printf("system cpu %.1f%%\n", 100.0 * (sys1 - sys0) / (tot1 - tot0));
+
+	if (b->stats) {
+		stats_snapshot(b->stats, &st1);
+		qsort(b->lat_us, b->lat_count, sizeof(b->lat_us[0]), cmp_u32);
+
+		printf("panel: %.1f fps, %.0f KB/s, %llu skipped, %llu dropped\n",
+			(st1.frames - st0.frames) * 1e9 / elapsed,
+			(st1.bytes - st0.bytes) * 1e9 / elapsed / 1024,
+			(unsigned long long)(st1.skipped - st0.skipped),
+			(unsigned long long)(st1.dropped - st0.dropped));
+		printf("driver busy %.1f%% of the time, %.0f%% of the bytes saved by damage tracking\n",
+			100.0 * (st1.busy_ns - st0.busy_ns) / elapsed,
+			st1.bytes_saved - st0.bytes_saved + st1.bytes - st0.bytes ?
+			100.0 * (st1.bytes_saved - st0.bytes_saved) /
+			(st1.bytes_saved - st0.bytes_saved + st1.bytes - st0.bytes) : 0);
+		if (b->lat_count)
+			printf("draw to visible: p50 %u us, p99 %u us, max %u us, %u of %u draws merged\n",
+				percentile(b, 50), percentile(b, 99),
+				b->lat_us[b->lat_count - 1], b->coalesced, draws);
+	}
+
+	return 0;
+}
@@ -0,0 +1,741 @@
+/*
+ * USBD480 device emulator on top of raw_gadget
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ Presents a USBD480 to the host through a gadget controller, normally
+ dummy_hcd, so the driver can be run and benchmarked without a panel:
+
+   modprobe dummy_hcd
+   modprobe raw_gadget
+   usbd480-emu -r 480x272 -s 1 -o frame.ppm
+
+ The vendor requests the driver uses are answered against a simulated
+ device memory and bulk data is written at the current address. SIGUSR1
+ writes the visible page to the -o file as a PPM and prints the counters.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/types.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define USBD480_VID	0x16C0
+#define USBD480_PID	0x08A6
+
+#define USBD480_SET_ADDRESS 0xC0
+#define USBD480_SET_FRAME_START_ADDRESS 0xC4
+#define USBD480_SET_BRIGHTNESS 0x81
+#define USBD480_GET_DEVICE_DETAILS 0x80
+
+#define USBD480_BULK_EP 0x02	/* the driver sends frame data here */
+#define USBD480_INT_MAXPACKET 16
+
+/* newer raw_gadget reports these, older kernels never send them */
+#define EMU_EVENT_RESET		5
+#define EMU_EVENT_DISCONNECT	6
+
+#define EMU_BULK_CHUNK (64*1024)	/* largest ep0 or bulk transfer */
+
+struct emu {
+	int fd;
+	int high_speed;
+	unsigned int width;
+	unsigned int height;
+	char name[20];
+
+	pthread_mutex_t lock;	/* everything below */
+	pthread_cond_t bulk_cond;	/* bulk_reading and bulk_hold changed */
+	int bulk_reading;	/* the bulk thread is in or about to enter a read */
+	int bulk_hold;		/* the control thread is changing the address */
+	unsigned char *mem;
+	unsigned long memsize;
+	unsigned int addr;	/* pixels, advanced by bulk data */
+	unsigned int frame_start;
+	unsigned int brightness;
+	uint64_t commands;
+	uint64_t bytes;
+	uint64_t flips;
+	uint64_t overruns;	/* bulk data past the end of memory */
+
+	int bulk_ep;		/* raw_gadget handle, -1 when not configured */
+	int int_addr;		/* interrupt IN endpoint address */
+	pthread_t bulk_thread;
+};
+
+static volatile sig_atomic_t emu_quit;
+static volatile sig_atomic_t emu_dump;
+
+static const char *dump_path = "usbd480-frame.ppm";
+
+struct emu_control {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+};
+
+struct emu_io {
+	struct usb_raw_ep_io inner;
+	unsigned char data[EMU_BULK_CHUNK];
+};
+
+static struct usb_device_descriptor emu_device = {
+	.bLength =		USB_DT_DEVICE_SIZE,
+	.bDescriptorType =	USB_DT_DEVICE,
+	.bcdUSB =		0x0200,
+	.bDeviceClass =		0,
+	.bMaxPacketSize0 =	64,
+	.idVendor =		USBD480_VID,
+	.idProduct =		USBD480_PID,
+	.bcdDevice =		0x0100,
+	.iManufacturer =	1,
+	.iProduct =		2,
+	.iSerialNumber =	3,
+	.bNumConfigurations =	1,
+};
+
+static const char * const emu_strings[] = {
+	NULL,
+	"usbd480fb",
+	"USBD480 emulator",
+	"EMU0001",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int emu_ep0_write(struct emu *e, const void *data, unsigned int len)
+{
+	struct emu_io io;
+
+	io.inner.ep = 0;
+	io.inner.flags = 0;
+	io.inner.length = len;
+	memcpy(io.data, data, len);
+	return ioctl(e->fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+}
+
+/* acks a request without a data stage, or reads its data */
+static int emu_ep0_read(struct emu *e, void *data, unsigned int len)
+{
+	struct emu_io io;
+	int ret;
+
+	io.inner.ep = 0;
+	io.inner.flags = 0;
+	io.inner.length = len;
+	ret = ioctl(e->fd, USB_RAW_IOCTL_EP0_READ, &io);
+	if (ret > 0 && data)
+		memcpy(data, io.data, ret);
+	return ret;
+}
+
+static void emu_ep0_stall(struct emu *e)
+{
+	ioctl(e->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+static unsigned int emu_bulk_maxpacket(struct emu *e)
+{
+	return e->high_speed ? 512 : 64;
+}
+
+static void emu_build_endpoints(struct emu *e, struct usb_endpoint_descriptor *bulk,
+		struct usb_endpoint_descriptor *intr)
+{
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->bLength = USB_DT_ENDPOINT_SIZE;
+	bulk->bDescriptorType = USB_DT_ENDPOINT;
+	bulk->bEndpointAddress = USBD480_BULK_EP | USB_DIR_OUT;
+	bulk->bmAttributes = USB_ENDPOINT_XFER_BULK;
+	bulk->wMaxPacketSize = emu_bulk_maxpacket(e);
+
+	memset(intr, 0, sizeof(*intr));
+	intr->bLength = USB_DT_ENDPOINT_SIZE;
+	intr->bDescriptorType = USB_DT_ENDPOINT;
+	intr->bEndpointAddress = e->int_addr | USB_DIR_IN;
+	intr->bmAttributes = USB_ENDPOINT_XFER_INT;
+	intr->wMaxPacketSize = USBD480_INT_MAXPACKET;
+	intr->bInterval = e->high_speed ? 7 : 10;	/* 8 ms, 10 ms */
+}
+
+static int emu_config_descriptor(struct emu *e, unsigned char *buf)
+{
+	struct usb_config_descriptor *config = (void *)buf;
+	struct usb_interface_descriptor *intf;
+	struct usb_endpoint_descriptor bulk, intr;
+	int len = 0;
+
+	memset(config, 0, USB_DT_CONFIG_SIZE);
+	config->bLength = USB_DT_CONFIG_SIZE;
+	config->bDescriptorType = USB_DT_CONFIG;
+	config->bNumInterfaces = 1;
+	config->bConfigurationValue = 1;
+	config->bmAttributes = USB_CONFIG_ATT_ONE;
+	config->bMaxPower = 250;	/* 500 mA */
+	len += USB_DT_CONFIG_SIZE;
+
+	intf = (void *)(buf + len);
+	memset(intf, 0, USB_DT_INTERFACE_SIZE);
+	intf->bLength = USB_DT_INTERFACE_SIZE;
+	intf->bDescriptorType = USB_DT_INTERFACE;
+	intf->bNumEndpoints = 2;
+	intf->bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+	intf->bInterfaceProtocol = 0;
+	len += USB_DT_INTERFACE_SIZE;
+
+	emu_build_endpoints(e, &bulk, &intr);
+	memcpy(buf + len, &bulk, USB_DT_ENDPOINT_SIZE);
+	len += USB_DT_ENDPOINT_SIZE;
+	memcpy(buf + len, &intr, USB_DT_ENDPOINT_SIZE);
+	len += USB_DT_ENDPOINT_SIZE;
+
+	config->wTotalLength = len;
+	return len;
+}
+
+static int emu_string_descriptor(int index, unsigned char *buf)
+{
+	const char *s;
+	int i, len;
+
+	if (index == 0) {
+		buf[0] = 4;
+		buf[1] = USB_DT_STRING;
+		buf[2] = 0x09;	/* en-US */
+		buf[3] = 0x04;
+		return 4;
+	}
+	if (index >= (int)(sizeof(emu_strings) / sizeof(emu_strings[0])))
+		return -1;
+
+	s = emu_strings[index];
+	len = strlen(s);
+	buf[0] = 2 + len * 2;
+	buf[1] = USB_DT_STRING;
+	for (i = 0; i < len; i++) {
+		buf[2 + i * 2] = s[i];
+		buf[3 + i * 2] = 0;
+	}
+	return buf[0];
+}
+
+/* an interrupt IN endpoint the gadget controller has at a fixed address */
+static void emu_find_endpoints(struct emu *e)
+{
+	struct usb_raw_eps_info info;
+	int n, i;
+
+	memset(&info, 0, sizeof(info));
+	n = ioctl(e->fd, USB_RAW_IOCTL_EPS_INFO, &info);
+	if (n < 0)
+		die("USB_RAW_IOCTL_EPS_INFO");
+
+	e->int_addr = 1;
+	for (i = 0; i < n; i++) {
+		struct usb_raw_ep_info *ep = &info.eps[i];
+
+		if (ep->caps.type_int && ep->caps.dir_in &&
+		    ep->addr != USB_RAW_EP_ADDR_ANY && ep->addr != USBD480_BULK_EP) {
+			e->int_addr = ep->addr;
+			break;
+		}
+	}
+}
+
+/* only gets the bulk thread out of its read, see emu_bulk_hold() */
+static void on_bulk_signal(int sig)
+{
+	(void)sig;
+}
+
+static void *emu_bulk_loop(void *arg)
+{
+	struct emu *e = arg;
+	struct emu_io *io;
+
+	io = malloc(sizeof(*io));
+	if (!io)
+		die("malloc");
+
+	for (;;) {
+		unsigned long off;
+		int ret;
+
+		pthread_mutex_lock(&e->lock);
+		while (e->bulk_hold)
+			pthread_cond_wait(&e->bulk_cond, &e->lock);
+		e->bulk_reading = 1;
+		pthread_mutex_unlock(&e->lock);
+
+		/*
+		 * One packet at a time. The driver sends no zero length
+		 * packets and its transfers are whole packets, so a larger
+		 * read would only end when full and could take the start of
+		 * the next transfer, meant for another address, with it.
+		 */
+		io->inner.ep = e->bulk_ep;
+		io->inner.flags = 0;
+		io->inner.length = emu_bulk_maxpacket(e);
+		ret = ioctl(e->fd, USB_RAW_IOCTL_EP_READ, io);
+
+		pthread_mutex_lock(&e->lock);
+		e->bulk_reading = 0;
+		pthread_cond_broadcast(&e->bulk_cond);
+		if (ret > 0) {
+			off = (unsigned long)e->addr * 2;
+			if (off + ret <= e->memsize)
+				memcpy(e->mem + off, io->data, ret);
+			else
+				e->overruns++;
+			e->addr += ret / 2;
+			e->bytes += ret;
+		}
+		pthread_mutex_unlock(&e->lock);
+
+		if (ret < 0 && (errno != EINTR || emu_quit))
+			break;
+	}
+
+	free(io);
+	return NULL;
+}
+
+/*
+ * Called with the lock held before the control thread changes the
+ * address. The host finishes a bulk transfer before it sends the next
+ * command, so its last packet is already in the controller, but the
+ * bulk thread may not have applied it yet. Interrupted, a read that has
+ * its packet returns it and one still waiting returns EINTR without
+ * data. The bulk thread is kicked until it is out of its read and then
+ * waits for emu_bulk_release(). A kick that comes before it enters the
+ * read is missed, so it is repeated.
+ */
+static void emu_bulk_hold(struct emu *e)
+{
+	struct timespec ts;
+
+	if (e->bulk_ep < 0)
+		return;
+
+	e->bulk_hold = 1;
+	while (e->bulk_reading) {
+		pthread_kill(e->bulk_thread, SIGUSR2);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&e->bulk_cond, &e->lock, &ts);
+	}
+}
+
+static void emu_bulk_release(struct emu *e)
+{
+	e->bulk_hold = 0;
+	pthread_cond_broadcast(&e->bulk_cond);
+}
+
+static void emu_configure(struct emu *e)
+{
+	struct usb_endpoint_descriptor bulk, intr;
+
+	if (e->bulk_ep >= 0)
+		return;
+
+	emu_build_endpoints(e, &bulk, &intr);
+	e->bulk_ep = ioctl(e->fd, USB_RAW_IOCTL_EP_ENABLE, &bulk);
+	if (e->bulk_ep < 0)
+		die("USB_RAW_IOCTL_EP_ENABLE bulk");
+	if (ioctl(e->fd, USB_RAW_IOCTL_EP_ENABLE, &intr) < 0)
+		die("USB_RAW_IOCTL_EP_ENABLE interrupt");
+
+	ioctl(e->fd, USB_RAW_IOCTL_VBUS_DRAW, 250);
+	if (ioctl(e->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+		die("USB_RAW_IOCTL_CONFIGURE");
+
+	if (pthread_create(&e->bulk_thread, NULL, emu_bulk_loop, e))
+		die("pthread_create");
+}
+
+/* after a reset the host enumerates again, the device memory is lost */
+static void emu_reset(struct emu *e)
+{
+	if (e->bulk_ep >= 0) {
+		ioctl(e->fd, USB_RAW_IOCTL_EP_DISABLE, e->bulk_ep);
+		pthread_join(e->bulk_thread, NULL);
+		e->bulk_ep = -1;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	memset(e->mem, 0, e->memsize);
+	e->addr = 0;
+	e->frame_start = 0;
+	pthread_mutex_unlock(&e->lock);
+}
+
+static int emu_standard_request(struct emu *e, struct usb_ctrlrequest *ctrl)
+{
+	unsigned char buf[256];
+	unsigned int len = ctrl->wLength;
+	int n;
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (ctrl->wValue >> 8) {
+		case USB_DT_DEVICE:
+			memcpy(buf, &emu_device, sizeof(emu_device));
+			n = sizeof(emu_device);
+			break;
+		case USB_DT_CONFIG:
+			n = emu_config_descriptor(e, buf);
+			break;
+		case USB_DT_STRING:
+			n = emu_string_descriptor(ctrl->wValue & 0xff, buf);
+			break;
+		default:
+			return -1;
+		}
+		if (n < 0)
+			return -1;
+		return emu_ep0_write(e, buf, (unsigned int)n < len ? (unsigned int)n : len);
+	case USB_REQ_GET_STATUS:
+		memset(buf, 0, 2);
+		return emu_ep0_write(e, buf, len < 2 ? len : 2);
+	case USB_REQ_SET_CONFIGURATION:
+		if (ctrl->wValue)
+			emu_configure(e);
+		return emu_ep0_read(e, NULL, 0);
+	case USB_REQ_SET_INTERFACE:
+		return emu_ep0_read(e, NULL, 0);
+	default:
+		return -1;
+	}
+}
+
+static int emu_vendor_request(struct emu *e, struct usb_ctrlrequest *ctrl)
+{
+	unsigned int value = ctrl->wValue | (ctrl->wIndex << 16);
+	unsigned char details[64];
+
+	pthread_mutex_lock(&e->lock);
+	e->commands++;
+	switch (ctrl->bRequest) {
+	case USBD480_GET_DEVICE_DETAILS:
+		pthread_mutex_unlock(&e->lock);
+		memset(details, 0, sizeof(details));
+		memcpy(details, e->name, sizeof(e->name));
+		details[20] = e->width;
+		details[21] = e->width >> 8;
+		details[22] = e->height;
+		details[23] = e->height >> 8;
+		/* firmware 0.5, the driver only flips pages from there on */
+		details[24] = 0x05;
+		details[25] = 0x00;
+		return emu_ep0_write(e, details,
+			ctrl->wLength < sizeof(details) ? ctrl->wLength : sizeof(details));
+	case USBD480_SET_ADDRESS:
+		emu_bulk_hold(e);
+		e->addr = value;
+		emu_bulk_release(e);
+		break;
+	case USBD480_SET_FRAME_START_ADDRESS:
+		e->frame_start = value;
+		e->flips++;
+		break;
+	case USBD480_SET_BRIGHTNESS:
+		e->brightness = ctrl->wValue;
+		break;
+	default:
+		e->commands--;
+		pthread_mutex_unlock(&e->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return emu_ep0_read(e, NULL, 0);
+}
+
+static void emu_dump_frame(struct emu *e)
+{
+	unsigned long off, pagesize = e->width * e->height * 2;
+	unsigned char *page;
+	unsigned int i;
+	FILE *f;
+
+	page = malloc(pagesize);
+	if (!page)
+		return;
+
+	pthread_mutex_lock(&e->lock);
+	off = (unsigned long)e->frame_start * 2;
+	if (off + pagesize <= e->memsize)
+		memcpy(page, e->mem + off, pagesize);
+	else
+		memset(page, 0, pagesize);
+	pthread_mutex_unlock(&e->lock);
+
+	f = fopen(dump_path, "wb");
+	if (!f) {
+		perror(dump_path);
+		free(page);
+		return;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", e->width, e->height);
+	for (i = 0; i < e->width * e->height; i++) {
+		unsigned int px = page[i * 2] | (page[i * 2 + 1] << 8);
+		unsigned char rgb[3];
+
+		rgb[0] = ((px >> 11) & 0x1f) * 255 / 31;
+		rgb[1] = ((px >> 5) & 0x3f) * 255 / 63;
+		rgb[2] = (px & 0x1f) * 255 / 31;
+		fwrite(rgb, 1, 3, f);
+	}
+	fclose(f);
+	free(page);
+}
+
+static void emu_print_stats(struct emu *e, uint64_t *last_bytes, uint64_t *last_flips,
+		uint64_t *last_ns)
+{
+	uint64_t now = now_ns();
+	double secs = (now - *last_ns) / 1e9;
+	uint64_t bytes, flips, commands, overruns;
+	unsigned int frame_start;
+
+	pthread_mutex_lock(&e->lock);
+	bytes = e->bytes;
+	flips = e->flips;
+	commands = e->commands;
+	overruns = e->overruns;
+	frame_start = e->frame_start;
+	pthread_mutex_unlock(&e->lock);
+
+	if (secs <= 0)
+		secs = 1;
+	printf("bytes %llu (%.0f KB/s) flips %llu (%.1f/s) commands %llu overruns %llu frame_start %u\n",
+		(unsigned long long)bytes, (bytes - *last_bytes) / secs / 1024,
+		(unsigned long long)flips, (flips - *last_flips) / secs,
+		(unsigned long long)commands, (unsigned long long)overruns, frame_start);
+	fflush(stdout);
+
+	*last_bytes = bytes;
+	*last_flips = flips;
+	*last_ns = now;
+}
+
+static int stats_interval;
+
+static void *emu_stats_loop(void *arg)
+{
+	struct emu *e = arg;
+	uint64_t last_bytes = 0, last_flips = 0, last_ns = now_ns();
+	uint64_t next = last_ns + stats_interval * 1000000000ULL;
+
+	while (!emu_quit) {
+		usleep(100000);
+		if (emu_dump) {
+			emu_dump = 0;
+			emu_dump_frame(e);
+			emu_print_stats(e, &last_bytes, &last_flips, &last_ns);
+		}
+		if (stats_interval && now_ns() >= next) {
+			emu_print_stats(e, &last_bytes, &last_flips, &last_ns);
+			next += stats_interval * 1000000000ULL;
+		}
+	}
+	return NULL;
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		emu_dump = 1;
+	else
+		emu_quit = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-r WxH] [-n name] [-m MiB] [-f] [-s secs] [-o file.ppm]\n"
+		"           [-d driver] [-u device]\n"
+		"  -r  resolution, e.g. 480x272, 640x480, 240x320, 800x256 (480x272)\n"
+		"  -n  device name reported to the host (USBD480-EMU)\n"
+		"  -m  device memory in MiB (8)\n"
+		"  -f  full speed instead of high speed\n"
+		"  -s  print throughput every secs seconds\n"
+		"  -o  where SIGUSR1 writes the visible frame (%s)\n"
+		"  -d  -u  UDC driver and device (dummy_udc, dummy_udc.0)\n",
+		prog, dump_path);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *driver = "dummy_udc";
+	const char *device = "dummy_udc.0";
+	struct usb_raw_init init;
+	struct sigaction sa;
+	pthread_t stats_thread;
+	struct emu e;
+	unsigned long mib = 8;
+	uint64_t total_bytes = 0, total_flips = 0, start_ns;
+	int opt;
+
+	memset(&e, 0, sizeof(e));
+	e.width = 480;
+	e.height = 272;
+	e.high_speed = 1;
+	e.bulk_ep = -1;
+	strcpy(e.name, "USBD480-EMU");
+	pthread_mutex_init(&e.lock, NULL);
+	pthread_cond_init(&e.bulk_cond, NULL);
+
+	while ((opt = getopt(argc, argv, "r:n:m:fs:o:d:u:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			if (sscanf(optarg, "%ux%u", &e.width, &e.height) != 2 ||
+			    !e.width || !e.height)
+				usage(argv[0]);
+			break;
+		case 'n':
+			strncpy(e.name, optarg, sizeof(e.name) - 1);
+			break;
+		case 'm':
+			mib = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			e.high_speed = 0;
+			break;
+		case 's':
+			stats_interval = atoi(optarg);
+			break;
+		case 'o':
+			dump_path = optarg;
+			break;
+		case 'd':
+			driver = optarg;
+			break;
+		case 'u':
+			device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	e.memsize = mib << 20;
+	if ((unsigned long)e.width * e.height * 2 > e.memsize) {
+		fprintf(stderr, "%ux%u does not fit in %lu MiB\n", e.width, e.height, mib);
+		return 1;
+	}
+	e.mem = calloc(1, e.memsize);
+	if (!e.mem)
+		die("calloc");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	/* no SA_RESTART, a signal gets the event loop out of its ioctl */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = on_bulk_signal;
+	sigaction(SIGUSR2, &sa, NULL);
+
+	e.fd = open("/dev/raw-gadget", O_RDWR);
+	if (e.fd < 0)
+		die("/dev/raw-gadget");
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = e.high_speed ? USB_SPEED_HIGH : USB_SPEED_FULL;
+	if (ioctl(e.fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		die("USB_RAW_IOCTL_INIT");
+	if (ioctl(e.fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		die("USB_RAW_IOCTL_RUN");
+
+	if (pthread_create(&stats_thread, NULL, emu_stats_loop, &e))
+		die("pthread_create");
+
+	start_ns = now_ns();
+	printf("emulating %s %ux%u, %s speed\n", e.name, e.width, e.height,
+		e.high_speed ? "high" : "full");
+	fflush(stdout);
+
+	while (!emu_quit) {
+		struct emu_control event;
+		int ret;
+
+		event.inner.type = 0;
+		event.inner.length = sizeof(event.ctrl);
+		if (ioctl(e.fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("USB_RAW_IOCTL_EVENT_FETCH");
+		}
+
+		switch (event.inner.type) {
+		case USB_RAW_EVENT_CONNECT:
+			emu_find_endpoints(&e);
+			continue;
+		case EMU_EVENT_RESET:
+		case EMU_EVENT_DISCONNECT:
+			emu_reset(&e);
+			continue;
+		case USB_RAW_EVENT_CONTROL:
+			break;
+		default:
+			continue;
+		}
+
+		switch (event.ctrl.bRequestType & USB_TYPE_MASK) {
+		case USB_TYPE_STANDARD:
+			ret = emu_standard_request(&e, &event.ctrl);
+			break;
+		case USB_TYPE_VENDOR:
+			ret = emu_vendor_request(&e, &event.ctrl);
+			break;
+		default:
+			ret = -1;
+		}
+		if (ret < 0)
+			emu_ep0_stall(&e);
+	}
+
+	emu_quit = 1;
+	pthread_join(stats_thread, NULL);
+	emu_dump_frame(&e);
+	emu_print_stats(&e, &total_bytes, &total_flips, &start_ns);
+	close(e.fd);
+	return 0;
+}
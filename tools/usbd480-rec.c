@@ -0,0 +1,473 @@
+/*
+ * USBD480 framebuffer recorder and replayer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ Records what an application draws into a framebuffer and plays it back
+ into another one, so different driver settings can be compared on the
+ same traffic:
+
+   usbd480-rec record -f /dev/fb1 -o terminal.rec -t 30
+   usbd480-rec replay -f /dev/fb2 -i terminal.rec \
+	-s /sys/bus/usb/devices/1-1:1.0/stats \
+	-d /sys/kernel/debug/usbd480fb/usbd480fb-fake.0
+
+ The recording samples the framebuffer every few ms and stores the span
+ of rows that changed since the previous sample. The file is a header
+ followed by 8 byte aligned frame records, it can be mapped and walked
+ without parsing.
+
+ Both follow the pan offset, so for a double buffered client the frame
+ on screen is recorded and the replay goes to the one on screen.
+
+ Replay reports what the driver did for it from the stats page (-s) and,
+ for a fake panel, the simulated link counters in debugfs (-d). The time
+ the driver spent sending comes from the stats page, the kernel CPU time
+ from /proc/stat covers the workers doing it.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/fb.h>
+
+#include "usbd480fb.h"
+
+#define REC_MAGIC "U480REC1"
+#define REC_VERSION 1
+
+struct rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;		/* bytes per row */
+	uint32_t bpp;
+	uint32_t interval_us;	/* sampling interval */
+	uint64_t frames;
+	uint64_t duration_ns;
+};
+
+/* followed by rows * pitch bytes, padded to 8 */
+struct rec_frame {
+	uint64_t t_ns;		/* since the start of the recording */
+	uint32_t first;
+	uint32_t rows;
+};
+
+#define REC_ALIGN(x) (((x) + 7) & ~7UL)
+
+struct fb {
+	int fd;
+	unsigned char *mem;
+	unsigned int width;
+	unsigned int height;
+	unsigned int pitch;
+	unsigned int bpp;
+	unsigned int yres_virtual;
+	size_t size;		/* of a frame */
+	size_t map_size;	/* all of them */
+};
+
+static volatile sig_atomic_t rec_quit;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !rec_quit)
+		;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	rec_quit = 1;
+}
+
+/* a full disk must not leave a header claiming frames that aren't there */
+static void rec_write(FILE *f, const void *buf, size_t len, const char *out)
+{
+	if (len && fwrite(buf, len, 1, f) != 1)
+		die(out);
+}
+
+static void fb_open(struct fb *fb, const char *path, int writable)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	fb->fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fb->fd < 0)
+		die(path);
+	if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) < 0 ||
+	    ioctl(fb->fd, FBIOGET_FSCREENINFO, &fix) < 0)
+		die("FBIOGET_*SCREENINFO");
+
+	fb->width = var.xres;
+	fb->height = var.yres;
+	fb->bpp = var.bits_per_pixel;
+	fb->pitch = fix.line_length;
+	fb->yres_virtual = var.yres_virtual < var.yres ? var.yres : var.yres_virtual;
+	fb->size = (size_t)fb->pitch * fb->height;
+	fb->map_size = (size_t)fb->pitch * fb->yres_virtual;
+	fb->mem = mmap(NULL, fb->map_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		MAP_SHARED, fb->fd, 0);
+	if (fb->mem == MAP_FAILED)
+		die("mmap framebuffer");
+}
+
+/* the frame on screen, a panning client moves it around */
+static unsigned char *fb_front(struct fb *fb)
+{
+	struct fb_var_screeninfo var;
+	unsigned int y = 0;
+
+	if (!ioctl(fb->fd, FBIOGET_VSCREENINFO, &var) &&
+	    var.yoffset + fb->height <= fb->yres_virtual)
+		y = var.yoffset;
+	return fb->mem + (size_t)y * fb->pitch;
+}
+
+static int record(const char *fbpath, const char *out, unsigned int interval_us,
+		unsigned int seconds)
+{
+	struct rec_header hdr;
+	struct fb fb;
+	unsigned char *prev;
+	uint64_t start, next, end;
+	FILE *f;
+	int first_sample = 1;
+
+	fb_open(&fb, fbpath, 0);
+	prev = calloc(1, fb.size);
+	if (!prev)
+		die("calloc");
+
+	f = fopen(out, "wb");
+	if (!f)
+		die(out);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+	hdr.version = REC_VERSION;
+	hdr.width = fb.width;
+	hdr.height = fb.height;
+	hdr.pitch = fb.pitch;
+	hdr.bpp = fb.bpp;
+	hdr.interval_us = interval_us;
+	rec_write(f, &hdr, sizeof(hdr), out);
+
+	start = now_ns();
+	next = start;
+	end = seconds ? start + seconds * 1000000000ULL : 0;
+
+	while (!rec_quit && (!end || next < end)) {
+		struct rec_frame fr;
+		static const unsigned char pad[8];
+		unsigned char *front = fb_front(&fb);
+		unsigned int y, first = fb.height, last = 0;
+		size_t len;
+
+		for (y = 0; y < fb.height; y++) {
+			size_t off = (size_t)y * fb.pitch;
+
+			if (!first_sample && !memcmp(prev + off, front + off, fb.pitch))
+				continue;
+			memcpy(prev + off, front + off, fb.pitch);
+			if (first > y)
+				first = y;
+			last = y;
+		}
+		first_sample = 0;
+
+		if (first < fb.height) {
+			fr.t_ns = now_ns() - start;
+			fr.first = first;
+			fr.rows = last - first + 1;
+			len = (size_t)fr.rows * fb.pitch;
+			rec_write(f, &fr, sizeof(fr), out);
+			rec_write(f, prev + (size_t)first * fb.pitch, len, out);
+			rec_write(f, pad, REC_ALIGN(len) - len, out);
+			hdr.frames++;
+		}
+
+		next += interval_us * 1000ULL;
+		sleep_until(next);
+	}
+
+	hdr.duration_ns = now_ns() - start;
+	if (fseek(f, 0, SEEK_SET))
+		die(out);
+	rec_write(f, &hdr, sizeof(hdr), out);
+	if (fclose(f))
+		die(out);
+
+	printf("%llu frames in %.1f s, %ux%u\n", (unsigned long long)hdr.frames,
+		hdr.duration_ns / 1e9, fb.width, fb.height);
+	return 0;
+}
+
+static int read_stats(const char *path, struct usbd480_stats *st)
+{
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = pread(fd, st, sizeof(*st), 0);
+	close(fd);
+	return ret == sizeof(*st) ? 0 : -1;
+}
+
+struct fake_stats {
+	unsigned long long commands;
+	unsigned long long bytes;
+	unsigned long long wire_ns;
+	unsigned long long flips;
+	unsigned long long mismatches;
+};
+
+static int read_fake_stats(const char *dir, struct fake_stats *fs)
+{
+	char path[512], key[32];
+	unsigned long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/fake_stats", dir);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	memset(fs, 0, sizeof(*fs));
+	while (fscanf(f, "%31[^:]: %llu\n", key, &val) == 2) {
+		if (!strcmp(key, "commands"))
+			fs->commands = val;
+		else if (!strcmp(key, "bytes"))
+			fs->bytes = val;
+		else if (!strcmp(key, "wire_ns"))
+			fs->wire_ns = val;
+		else if (!strcmp(key, "flips"))
+			fs->flips = val;
+		else if (!strcmp(key, "mismatches"))
+			fs->mismatches = val;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * System, irq and softirq time of all CPUs. The uploads run in kernel
+ * workers, which this includes, while the replay itself only copies in
+ * userspace.
+ */
+static double kernel_cpu_seconds(void)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq;
+	FILE *f = fopen("/proc/stat", "r");
+	int n;
+
+	if (!f)
+		return 0;
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+		&system, &idle, &iowait, &irq, &softirq);
+	fclose(f);
+	if (n != 7)
+		return 0;
+	return (double)(system + irq + softirq) / sysconf(_SC_CLK_TCK);
+}
+
+static int replay(const char *fbpath, const char *in, double speed,
+		const char *stats_path, const char *fake_dir)
+{
+	struct usbd480_stats st0, st1;
+	struct fake_stats fs0, fs1;
+	const struct rec_header *hdr;
+	struct fb fb;
+	struct stat sb;
+	unsigned char *rec, *p;
+	uint64_t start, n, copied = 0;
+	double cpu;
+	int have_stats, have_fake;
+	int fd;
+
+	fd = open(in, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		die(in);
+	rec = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (rec == MAP_FAILED)
+		die("mmap recording");
+	hdr = (const void *)rec;
+	if (sb.st_size < (off_t)sizeof(*hdr) || memcmp(hdr->magic, REC_MAGIC, 8) ||
+	    hdr->version != REC_VERSION) {
+		fprintf(stderr, "%s: not a recording\n", in);
+		return 1;
+	}
+
+	fb_open(&fb, fbpath, 1);
+	if (fb.width != hdr->width || fb.height != hdr->height || fb.pitch != hdr->pitch ||
+	    fb.bpp != hdr->bpp) {
+		fprintf(stderr, "recording is %ux%u %u bpp, framebuffer is %ux%u %u bpp\n",
+			hdr->width, hdr->height, hdr->bpp, fb.width, fb.height, fb.bpp);
+		return 1;
+	}
+
+	have_stats = stats_path && !read_stats(stats_path, &st0);
+	have_fake = fake_dir && !read_fake_stats(fake_dir, &fs0);
+
+	cpu = kernel_cpu_seconds();
+	start = now_ns();
+	p = rec + sizeof(*hdr);
+	for (n = 0; n < hdr->frames && !rec_quit; n++) {
+		const struct rec_frame *fr = (const void *)p;
+		size_t len = (size_t)fr->rows * hdr->pitch;
+
+		if (p + sizeof(*fr) + len > rec + sb.st_size ||
+		    fr->first + fr->rows > hdr->height) {
+			fprintf(stderr, "%s: truncated at frame %llu\n", in,
+				(unsigned long long)n);
+			break;
+		}
+
+		if (speed > 0)
+			sleep_until(start + (uint64_t)(fr->t_ns / speed));
+		/* a panning client may have flipped since the last frame */
+		memcpy(fb_front(&fb) + (size_t)fr->first * hdr->pitch, p + sizeof(*fr), len);
+		copied += len;
+		p += sizeof(*fr) + REC_ALIGN(len);
+	}
+
+	/* give the driver a few refreshes to send the last frame */
+	usleep(100000);
+	cpu = kernel_cpu_seconds() - cpu;
+
+	printf("replayed %llu frames, %llu bytes in %.2f s, kernel cpu %.3f s\n",
+		(unsigned long long)n, (unsigned long long)copied,
+		(now_ns() - start) / 1e9, cpu);
+
+	if (have_stats && !read_stats(stats_path, &st1)) {
+		uint64_t frames = st1.frames - st0.frames;
+
+		/* busy is the time the upload engine spent on these frames */
+		printf("driver: frames %llu bytes %llu saved %llu dropped %llu busy %.3f s\n",
+			(unsigned long long)frames,
+			(unsigned long long)(st1.bytes - st0.bytes),
+			(unsigned long long)(st1.bytes_saved - st0.bytes_saved),
+			(unsigned long long)(st1.dropped - st0.dropped),
+			(st1.busy_ns - st0.busy_ns) / 1e9);
+		printf("driver: latency p50 %u us p99 %u us max %u us\n",
+			st1.latency_p50_us, st1.latency_p99_us, st1.latency_max_us);
+	}
+
+	if (have_fake && !read_fake_stats(fake_dir, &fs1)) {
+		printf("link: commands %llu bytes %llu wire %.3f s flips %llu mismatches %llu\n",
+			fs1.commands - fs0.commands, fs1.bytes - fs0.bytes,
+			(fs1.wire_ns - fs0.wire_ns) / 1e9, fs1.flips - fs0.flips,
+			fs1.mismatches - fs0.mismatches);
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s record -f /dev/fbN -o file [-i interval_us] [-t seconds]\n"
+		"       %s replay -f /dev/fbN -i file [-x speed] [-s stats] [-d debugfs dir]\n"
+		"  record samples every 10000 us until interrupted by default\n"
+		"  replay -x 0 plays the frames back to back instead of in real time\n",
+		prog, prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *fbpath = NULL, *file = NULL, *stats_path = NULL, *fake_dir = NULL;
+	unsigned int interval_us = 10000, seconds = 0;
+	double speed = 1;
+	struct sigaction sa;
+	int rec, opt;
+
+	if (argc < 2)
+		usage(argv[0]);
+	if (!strcmp(argv[1], "record"))
+		rec = 1;
+	else if (!strcmp(argv[1], "replay"))
+		rec = 0;
+	else
+		usage(argv[0]);
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "f:o:i:t:x:s:d:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fbpath = optarg;
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case 'i':
+			if (rec)
+				interval_us = strtoul(optarg, NULL, 0);
+			else
+				file = optarg;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			speed = strtod(optarg, NULL);
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 'd':
+			fake_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!fbpath || !file || !interval_us)
+		usage(argv[0]);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (rec)
+		return record(fbpath, file, interval_us, seconds);
+	return replay(fbpath, file, speed, stats_path, fake_dir);
+}
@@ -26,17 +26,17 @@
  To use this driver you should be running firmware version 0.5 (2009/05/28) or later. 
  
  Tested with display resolutions 480x272, 640x480, 240x320, 800x256
+
+ Builds against Linux 6.11 and later.
 */
 
 /*
 TODO:
--error handling
 -backlight support - separate driver?
 -double buffering
 -alternatively instead of continuosly updating the display wait for an update command from
  application?
 -performance optimisation
--suspend/resume?
 
 */
 
@@ -50,8 +50,36 @@ TODO:
 #include <linux/mm.h>
 #include <linux/fb.h>
 #include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/pm_runtime.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/firmware.h>
+#include <linux/mutex.h>
+#include <linux/jhash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/platform_device.h>
+#include <linux/delay.h>
+#include <linux/uio.h>
+#include <linux/miscdevice.h>
+#include <linux/eventfd.h>
+#include <linux/kfifo.h>
+#include <linux/scatterlist.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/configfs.h>
+#include <asm/unaligned.h>
+
+#include "usbd480fb.h"
+
+#define CREATE_TRACE_POINTS
+#include "usbd480fb_trace.h"
 
-#define USBD480_INTEPDATASIZE 16
 
 #define USBD480_VID	0x16C0
 #define USBD480_PID	0x08A6
@@ -62,14 +90,32 @@ TODO:
 #define USBD480_GET_DEVICE_DETAILS 0x80
 
 
-#define IOCTL_SET_BRIGHTNESS 0x10
-#define IOCTL_GET_DEVICE_DETAILS 0x20
+#define USBD480_MINOR_BASE 192
+#define USBD480_BATCH_MAX (4*1024*1024)	/* bytes of commands parsed per write */
+#define USBD480_SPAN_GAP 8		/* unchanged rows worth sending to save a command */
+#define USBD480_JOBS_MAX 8		/* user pointer submissions in flight */
+#define USBD480_COMPLETIONS 64		/* must be a power of 2 */
+
+#define USBD480_CTRL_TIMEOUT 250	/* ms, commands normally complete in 1 */
+#define USBD480_BULK_TIMEOUT_MARGIN 50	/* ms added to the expected transfer time */
+#define USBD480_BULK_RATE_HS 20000	/* bytes/ms, well below what the device does */
+#define USBD480_BULK_RATE_FS 800
+#define USBD480_MAX_RETRIES 5		/* consecutive failures before a port reset */
+#define USBD480_MAX_BACKOFF 6		/* retry delay doubles up to 64 refreshes */
 
+#define USBD480_SPLASH_PAGE 2		/* after the two pages used for updates */
 
-#define USBD480_VIDEOMEMORDER (get_order(PAGE_ALIGN(dev->vmemsize)))
+#define USBD480_DETAILS_VERSION 24	/* offsets in the GET_DEVICE_DETAILS reply */
+#define USBD480_DETAILS_SERIAL 26
+#define USBD480_SERIAL_LEN 10
 
-#define USBD480_REFRESH_DELAY 1000/100 /* about xx fps, less in practice */
-#define USBD480_REFRESH_JIFFIES ((USBD480_REFRESH_DELAY * HZ)/1000)
+#define USBD480_CAP_PARTIAL	BIT(0)	/* SET_ADDRESS to any row, damaged rows sent alone */
+#define USBD480_CAP_PAGES	BIT(1)	/* SET_FRAME_START_ADDRESS, flipping between pages */
+#define USBD480_CAP_ALL		(USBD480_CAP_PARTIAL | USBD480_CAP_PAGES)
+
+#define USBD480_XFER_URBS 2		/* bulk urbs in flight while a frame is sent */
+#define USBD480_XFER_SIZE (64*1024)
+#define USBD480_XFER_SIZE_FS (8*1024)	/* about 8ms of a full speed link */
 
 #define USBD480_DEVICE(vid, pid)			\
 	.match_flags = USB_DEVICE_ID_MATCH_DEVICE | 	\
@@ -88,39 +134,481 @@ MODULE_DEVICE_TABLE (usb, id_table);
 
 static int refresh_delay = 10;
 module_param(refresh_delay, int, 0);
-MODULE_PARM_DESC(refresh_delay, "Delay between display refreshes");
+MODULE_PARM_DESC(refresh_delay, "Delay between display refreshes in ms, unless a profile sets it");
+
+static int autosuspend_delay = 5000;
+module_param(autosuspend_delay, int, 0);
+MODULE_PARM_DESC(autosuspend_delay, "Idle time in ms before the display is suspended (<0 disables)");
+
+static char *splash;
+module_param(splash, charp, 0);
+MODULE_PARM_DESC(splash, "Firmware file with a RGB565 image shown from probe until the first update");
+
+static uint caps_mask = USBD480_CAP_ALL;
+module_param(caps_mask, uint, 0);
+MODULE_PARM_DESC(caps_mask, "Firmware capabilities to use, 1 partial updates, 2 page flipping");
+
+static int idle_release = 0;
+module_param(idle_release, int, 0);
+MODULE_PARM_DESC(idle_release, "Seconds without damage before shadow and transfer buffers are freed (0 disables)");
+
+static int fake_panels = 0;
+module_param(fake_panels, int, 0);
+MODULE_PARM_DESC(fake_panels, "Number of simulated panels to create, for testing without hardware");
+
+static int fake_width = 480;
+module_param(fake_width, int, 0);
+MODULE_PARM_DESC(fake_width, "Width of the simulated panels");
+
+static int fake_height = 272;
+module_param(fake_height, int, 0);
+MODULE_PARM_DESC(fake_height, "Height of the simulated panels");
+
+static int fake_bandwidth = 20000;
+module_param(fake_bandwidth, int, 0);
+MODULE_PARM_DESC(fake_bandwidth, "Simulated bulk bandwidth in KB/s (0 for unlimited)");
+
+static int fake_latency = 125;
+module_param(fake_latency, int, 0);
+MODULE_PARM_DESC(fake_latency, "Simulated time per command in us");
+
+static bool fake_realtime = 1;
+module_param(fake_realtime, bool, 0);
+MODULE_PARM_DESC(fake_realtime, "Sleep for the simulated wire time instead of only counting it");
+
+#define USBD480_FAKE_MAX 4
+#define USBD480_FAKE_MEM_SIZE (8*1024*1024)	/* bytes of simulated device memory */
+
+#define USBD480_TILE 16		/* heatmap tile size in pixels */
+#define USBD480_GLYPH_PAIRS 4		/* colour pairs with expanded glyph bytes */
+
+struct usbd480_glyphs {
+	u32 fg;
+	u32 bg;
+	int valid;
+	u16 px[256][8];
+};
+
+#define USBD480_HIST_BUCKETS 24	/* bucket n counts [2^n, 2^(n+1)) us */
+
+enum {
+	USBD480_LAT_DAMAGE_TO_SUBMIT,
+	USBD480_LAT_SET_ADDRESS,
+	USBD480_LAT_BULK_PER_KB,
+	USBD480_LAT_FRAME_START,
+	USBD480_LAT_DAMAGE_TO_VISIBLE,
+	USBD480_LAT_COUNT,
+};
+
+static const char * const usbd480_lat_names[USBD480_LAT_COUNT] = {
+	"damage_to_submit",
+	"set_address",
+	"bulk_per_kb",
+	"frame_start",
+	"damage_to_visible",
+};
+
+struct usbd480_hist {
+	u64 count;
+	u64 sum;
+	u64 max;
+	u32 bucket[USBD480_HIST_BUCKETS];
+};
+
+enum {
+	USBD480_TEST_FULL,
+	USBD480_TEST_ROW,
+	USBD480_TEST_SCATTER,
+	USBD480_TEST_FLIP,
+	USBD480_TEST_COUNT,
+};
+
+static const char * const usbd480_test_names[USBD480_TEST_COUNT] = {
+	"full_frame",
+	"single_row",
+	"scattered_rows",
+	"flips",
+};
+
+#define USBD480_TEST_FULL_RUNS 20
+#define USBD480_TEST_ROW_RUNS 100
+#define USBD480_TEST_SCATTER_RUNS 20
+#define USBD480_TEST_SCATTER_ROWS 16
+#define USBD480_TEST_FLIP_RUNS 100
+
+struct usbd480_test {
+	unsigned int runs;
+	u64 bytes;
+	u64 ns;
+};
+
+static struct dentry *usbd480_debugfs_root;
+
+struct usbd480_xfer {
+	struct urb *urb;
+	struct completion done;
+	int busy;
+};
+
+struct usbd480;
+
+/*
+ * How commands and pixel data get to the panel. Addresses are in pixels
+ * like on the device. Everything above this talks to the panel only
+ * through the wrappers calling these.
+ */
+struct usbd480_transport {
+	const char *name;
+	int (*get_details)(struct usbd480 *d);
+	int (*set_address)(struct usbd480 *d, unsigned int addr);
+	int (*set_frame_start)(struct usbd480 *d, unsigned int addr);
+	int (*set_brightness)(struct usbd480 *d, unsigned int brightness);
+	int (*write)(struct usbd480 *d, const unsigned char *src, unsigned int len);
+	/* optional, zero copy write of pinned pages */
+	int (*write_pages)(struct usbd480 *d, struct page **pages, unsigned int npages,
+			unsigned int offset, unsigned int len);
+	int (*clear_halt)(struct usbd480 *d);
+	void (*reset)(struct usbd480 *d);
+};
+
+/*
+ * State of a simulated panel: device memory, the write pointer and the
+ * frame start, plus what the link would have carried.
+ */
+struct usbd480_fake {
+	struct mutex lock;
+	unsigned char *mem;
+	unsigned long memsize;
+	unsigned int addr;
+	unsigned int frame_start;
+	unsigned int brightness;
+	u64 commands;
+	u64 bytes;
+	u64 wire_ns;
+	u64 flips;
+	u64 mismatches;		/* flips showing something other than the shadow */
+	u64 halts;
+	u64 resets;
+	int fail_writes;	/* writes to fail with fail_error, for the KUnit suite */
+	int fail_error;
+};
 
 struct usbd480 {
-	struct usb_device *udev;
+	struct device *dev;	/* interface or platform device, for logging and sysfs */
+	const struct usbd480_transport *tp;
+	struct usb_device *udev;	/* NULL for a fake panel */
+	struct usb_interface *intf;
+	unsigned int bulk_pipe;		/* frame data out */
+	unsigned int maxpacket;		/* of the bulk endpoint */
+	unsigned int chunk;		/* bytes per bulk urb, whole packets */
+	struct usbd480_fake *fake;	/* NULL for a real panel */
+	struct kref kref;
+	struct usb_anchor submitted;	/* every urb sent to the device */
+	struct usbd480_xfer xfer[USBD480_XFER_URBS];
 	struct fb_info *fbinfo;
 	struct delayed_work work;
 	struct workqueue_struct *wq;
 
-	unsigned char *vmem;
-	unsigned long vmemsize;
-	unsigned long vmem_phys;
+	struct mutex mem_lock;	/* vmem, shadow and xfer buffers coming and going */
+	unsigned char *vmem;	/* allocated on first open, two frames */
+	unsigned long vmemsize;	/* one frame */
+	unsigned int yoffset;	/* first row of vmem shown, from panning */
+	int hint_first;		/* rows reported by IOCTL_DAMAGE, */
+	int hint_last;		/* -1 for none */
+	u32 passes;		/* worker runs done */
+	spinlock_t ops_lock;	/* damage from the drawing ops */
+	int ops_first;		/* rows of framebuffer memory drawn to, */
+	int ops_last;		/* -1 for none */
+	int ops_full;		/* compare everything next time */
+	atomic_t mapped;	/* mappings of the framebuffer */
+	struct usbd480_glyphs *glyphs;
+	unsigned int glyph_next;	/* pair to replace next */
+	int scroll_pending;	/* rows scrolled up by copyarea, under ops_lock, */
+				/* -1 when the moves don't add up to a scroll */
+	int scroll_delta;	/* rows each move went up, 0 before the first */
+	int scroll_dy;		/* where the last move went */
+	int scroll_dx;
+	int scrolling;		/* frames go to the shown page, see usbd480_scroll() */
+	unsigned int scroll_start;	/* frame start while scrolling */
+	int scroll_moved;	/* rows the frame start has still to move */
+	int stale_first;	/* rows the shadow can't vouch for after a scroll, */
+	int stale_last;		/* -1 for none */
+	wait_queue_head_t pass_wait;
 	unsigned int disp_page;
+	unsigned char *shadow;	/* copy of the frame last sent to the device */
+	u32 *row_hash;		/* stands in for the shadow after idle_release */
+	const struct firmware *splash_fw;	/* kept to seed vmem on the first open */
+	unsigned long last_damage;
+	int shadow_valid;
+	int pages_stale;	/* frames to send in full before going partial */
+	int prev_first;		/* rows sent in the previous frame, */
+	int prev_last;		/* missing from the back page */
+	int suspended;
 	unsigned char brightness;
+	int brightness_set;
+	u64 damage_ns;		/* when the damage not yet on screen was seen */
+	u64 scan_ns;		/* when the last damage scan started */
+	spinlock_t hist_lock;	/* also serialises stats updates */
+	struct usbd480_hist hist[USBD480_LAT_COUNT];
+	struct usbd480_stats *stats;	/* page shared with userspace */
+	unsigned int tiles_x;
+	unsigned int tiles_y;
+	unsigned long *tile_dirty;	/* tiles damaged in the current frame */
+	u32 *tile_damaged;		/* per tile counts since the last reset */
+	u32 *tile_uploaded;
+	u32 heatmap_frames;
+	u64 rate_ns;
+	u64 rate_frames;
+	u64 rate_bytes;
+	struct dentry *debugfs;
+	ktime_t probe_time;
+	int first_frame_ms;	/* probe to first frame on screen, -1 until then */
+	struct usbd480_test selftest[USBD480_TEST_COUNT];
+	int selftest_result;
+	int selftest_done;
+	int selftest_running;	/* between the patterns of a run */
+	int direct;		/* character device open, the poller stays idle */
+	unsigned char *direct_page[USBD480_DIRECT_PAGES];	/* host copy of device pages */
+	unsigned long *direct_dirty[USBD480_DIRECT_PAGES];	/* rows not yet sent */
+	unsigned int direct_shown;
+	unsigned int direct_bytes;	/* sent since the last flip */
+	u32 fence;		/* id of the last fence done */
+	spinlock_t job_lock;	/* jobs and completions */
+	struct list_head jobs;	/* user pointer submissions not yet sent */
+	atomic_t jobs_queued;
+	struct work_struct job_work;
+	DECLARE_KFIFO(completions, struct usbd480_completion, USBD480_COMPLETIONS);
+	unsigned long completions_lost;	/* completions nobody read in time */
+	struct mutex read_lock;
+	wait_queue_head_t direct_wait;
+	struct miscdevice misc;	/* character device of a fake panel */
+	int retries;		/* consecutive failed frames */
+	unsigned long errors;
+	int gone;
 	unsigned int width;
 	unsigned int height;
 	char device_name[20];
+	char serial[USBD480_SERIAL_LEN + 1];
+	u16 fw_version;		/* 0 when the firmware does not say */
+	unsigned int caps;	/* USBD480_CAP_* */
+	unsigned long memsize;	/* bytes of device memory */
+	unsigned int pages;	/* frames that fit in it */
+	unsigned long refresh;	/* jiffies between worker runs */
+	int full_frames;	/* never send only the damaged rows */
+	int rotate;		/* upside down, 180 degrees */
+	unsigned char *rotbuf;	/* rows turned around on their way out */
+	int highpri;		/* worker on a high priority queue */
+	char profile[32];	/* configfs profile applied at probe */
+};
+
+static struct usb_driver usbd480_driver;
+
+static void usbd480_free_xfers(struct usbd480 *dev)
+{
+	int i;
+
+	for (i = 0; i < USBD480_XFER_URBS; i++) {
+		struct urb *urb = dev->xfer[i].urb;
+
+		if (!urb)
+			continue;
+		usb_free_coherent(dev->udev, USBD480_XFER_SIZE,
+				urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		dev->xfer[i].urb = NULL;
+	}
+}
+
+static void usbd480_delete(struct kref *kref)
+{
+	struct usbd480 *dev = container_of(kref, struct usbd480, kref);
+
+	usbd480_free_xfers(dev);
+	/* a mapping of the stats page keeps its own reference */
+	free_page((unsigned long)dev->stats);
+	bitmap_free(dev->tile_dirty);
+	kfree(dev->tile_damaged);
+	kfree(dev->tile_uploaded);
+	vfree(dev->shadow);
+	vfree(dev->rotbuf);
+	kfree(dev->glyphs);
+	kfree(dev->row_hash);
+	release_firmware(dev->splash_fw);
+	if (dev->fake) {
+		vfree(dev->fake->mem);
+		kfree(dev->fake);
+	}
+	usb_put_dev(dev->udev);
+	kfree(dev);
+}
+
+static void usbd480_urb_complete(struct urb *urb)
+{
+	trace_usbd480_urb_complete(urb);
+	complete(urb->context);
+}
+
+static int usbd480_wait_urb(struct urb *urb, struct completion *done, unsigned int timeout)
+{
+	if (!wait_for_completion_timeout(done, msecs_to_jiffies(timeout))) {
+		usb_kill_urb(urb);
+		return -ETIMEDOUT;
+	}
+	if (urb->status)
+		return urb->status;
+	if (usb_pipeout(urb->pipe) && urb->actual_length != urb->transfer_buffer_length)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * All urbs go through the anchor so disconnect can kill whatever is in
+ * flight instead of waiting for it to time out.
+ */
+static int usbd480_submit_urb(struct usbd480 *dev, struct urb *urb)
+{
+	int result;
+
+	trace_usbd480_urb_submit(urb);
+	usb_anchor_urb(urb, &dev->submitted);
+	/* anchored first, so teardown's poisoning catches it if this misses */
+	if (READ_ONCE(dev->gone))
+		result = -ENODEV;
+	else
+		result = usb_submit_urb(urb, GFP_KERNEL);
+	if (result)
+		usb_unanchor_urb(urb);
+	return result;
+}
+
+/* 
+ * Same as usb_control_msg() but killable through the anchor. Returns the
+ * number of bytes transferred or a negative error.
+ */
+static int usbd480_ctrl_msg(struct usbd480 *dev, __u8 request, __u8 requesttype,
+		__u16 value, __u16 index, void *data, __u16 size, unsigned int timeout)
+{
+	struct usb_ctrlrequest *setup;
+	struct completion done;
+	struct urb *urb;
+	unsigned int pipe;
+	int result;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	setup = kmalloc(sizeof(*setup), GFP_KERNEL);
+	if (!urb || !setup) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	setup->bRequestType = requesttype;
+	setup->bRequest = request;
+	setup->wValue = cpu_to_le16(value);
+	setup->wIndex = cpu_to_le16(index);
+	setup->wLength = cpu_to_le16(size);
+
+	if (requesttype & USB_DIR_IN)
+		pipe = usb_rcvctrlpipe(dev->udev, 0);
+	else
+		pipe = usb_sndctrlpipe(dev->udev, 0);
+
+	init_completion(&done);
+	usb_fill_control_urb(urb, dev->udev, pipe, (unsigned char *)setup,
+			data, size, usbd480_urb_complete, &done);
+
+	result = usbd480_submit_urb(dev, urb);
+	if (!result)
+		result = usbd480_wait_urb(urb, &done, timeout);
+	if (!result)
+		result = urb->actual_length;
+out:
+	kfree(setup);
+	usb_free_urb(urb);
+	return result;
+}
+
+static int usbd480_alloc_xfers(struct usbd480 *dev)
+{
+	int i;
+
+	/* only the USB transport streams through urbs */
+	if (!dev->udev)
+		return 0;
+
+	for (i = 0; i < USBD480_XFER_URBS; i++) {
+		struct usbd480_xfer *x = &dev->xfer[i];
+		unsigned char *buf;
+		dma_addr_t dma;
+
+		if (x->urb)
+			continue;
+
+		x->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!x->urb)
+			return -ENOMEM;
+
+		buf = usb_alloc_coherent(dev->udev, USBD480_XFER_SIZE, GFP_KERNEL, &dma);
+		if (!buf) {
+			usb_free_urb(x->urb);
+			x->urb = NULL;
+			return -ENOMEM;
+		}
+
+		init_completion(&x->done);
+		usb_fill_bulk_urb(x->urb, dev->udev, dev->bulk_pipe,
+				buf, USBD480_XFER_SIZE, usbd480_urb_complete, &x->done);
+		x->urb->transfer_dma = dma;
+		x->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+
+	return 0;
+}
+
+/*
+ * What each firmware can do, the last entry at or below the version
+ * applies. Firmware older than 0.5, or that does not report a version,
+ * only gets full frames written to address 0 and shown from there.
+ * 0.5 is the release the original driver required for its two pages.
+ * Its memory is what that driver used on a 640x480 panel, three frames
+ * from address 0 to the end of the second page. A bigger panel doesn't
+ * come with more of it.
+ */
+static const struct usbd480_fw {
+	u16 version;
+	unsigned int caps;
+	unsigned long memsize;	/* bytes of device memory, 0 for one frame */
+} usbd480_fws[] = {
+	{ 0x0000, 0, 0 },
+	{ 0x0005, USBD480_CAP_ALL, 3 * 640 * 480 * 2 },
 };
 
-static int usbd480_get_device_details(struct usbd480 *dev)
+static void usbd480_fw_caps(struct usbd480 *dev)
 {
-// TODO: return value handling
+	const struct usbd480_fw *fw = &usbd480_fws[0];
+	int i;
+
+	for (i = 1; i < ARRAY_SIZE(usbd480_fws); i++)
+		if (dev->fw_version >= usbd480_fws[i].version)
+			fw = &usbd480_fws[i];
+
+	dev->caps = fw->caps;
+	dev->memsize = fw->memsize;
+	if (!dev->memsize)
+		dev->memsize = (unsigned long)dev->width * dev->height * 2;
+}
 
+static int usbd480_usb_get_details(struct usbd480 *dev)
+{
 	int result;
 	unsigned char *buffer;
 
 	buffer = kmalloc(64, GFP_KERNEL);
 	if (!buffer) {
-		dev_err(&dev->udev->dev, "out of memory\n");
-		return 0;
+		dev_err(dev->dev, "out of memory\n");
+		return -ENOMEM;
 	}
 
-	result = usb_control_msg(dev->udev,
-				usb_rcvctrlpipe(dev->udev, 0),
+	result = usbd480_ctrl_msg(dev,
 				USBD480_GET_DEVICE_DETAILS,
 				USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
 				0,
@@ -128,321 +616,3387 @@ static int usbd480_get_device_details(struct usbd480 *dev)
 				buffer,	
 				64,
 				1000);
-	if (result)
-		dev_dbg(&dev->udev->dev, "result = %d\n", result);
+	if (result < 24) {
+		dev_err(dev->dev, "GET_DEVICE_DETAILS failed, result = %d\n", result);
+		kfree(buffer);
+		return result < 0 ? result : -EIO;
+	}
 
 	dev->width = (unsigned char)buffer[20] | ((unsigned char)buffer[21]<<8);
 	dev->height = (unsigned char)buffer[22] | ((unsigned char)buffer[23]<<8);
 	strncpy(dev->device_name, buffer, 20);
+	dev->device_name[19] = 0;
+
+	/* older firmware replies with only the fields above */
+	if (result >= USBD480_DETAILS_VERSION + 2)
+		dev->fw_version = get_unaligned_le16(buffer + USBD480_DETAILS_VERSION);
+	if (result >= USBD480_DETAILS_SERIAL + USBD480_SERIAL_LEN) {
+		memcpy(dev->serial, buffer + USBD480_DETAILS_SERIAL, USBD480_SERIAL_LEN);
+		dev->serial[USBD480_SERIAL_LEN] = 0;
+	}
 	kfree(buffer);	
 
+	usbd480_fw_caps(dev);
 	return 0;
 }
 
-static int usbd480_set_brightness(struct usbd480 *dev, unsigned int brightness)	
+static int usbd480_usb_set_brightness(struct usbd480 *dev, unsigned int brightness)	
 {
-// TODO: return value handling, check valid dev?
-	
 	int result;
 
-	result = usb_control_msg(dev->udev,
-				usb_sndctrlpipe(dev->udev, 0),
+	result = usbd480_ctrl_msg(dev,
 				USBD480_SET_BRIGHTNESS,
 				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
 				brightness,
 				0,
 				NULL,	
 				0,
-				1000);
+				USBD480_CTRL_TIMEOUT);
 	if (result)
-		dev_dbg(&dev->udev->dev, "result = %d\n", result);
+		dev_dbg(dev->dev, "result = %d\n", result);
 						
-	return 0;							
+	return result;
 }
 
-static int usbd480_set_address(struct usbd480 *dev, unsigned int addr)
+static int usbd480_usb_set_address(struct usbd480 *dev, unsigned int addr)
 {
-// TODO: return value handling
 	int result;
 
-	result = usb_control_msg(dev->udev,
-				usb_sndctrlpipe(dev->udev, 0),
+	result = usbd480_ctrl_msg(dev,
 				USBD480_SET_ADDRESS,
 				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
 				addr,
 				addr>>16,
 				NULL,	
 				0,
-				1000);
+				USBD480_CTRL_TIMEOUT);
 	if (result)
-		dev_dbg(&dev->udev->dev, "result = %d\n", result);
+		dev_dbg(dev->dev, "result = %d\n", result);
 						
-	return 0;	
+	return result;
 }
 
-static int usbd480_set_frame_start_address(struct usbd480 *dev, unsigned int addr)
+static int usbd480_usb_set_frame_start(struct usbd480 *dev, unsigned int addr)
 {
-// TODO: return value handling
 	int result;
 
-	result = usb_control_msg(dev->udev,
-				usb_sndctrlpipe(dev->udev, 0),
+	result = usbd480_ctrl_msg(dev,
 				USBD480_SET_FRAME_START_ADDRESS,
 				USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
 				addr,
 				addr>>16,
 				NULL,	
 				0,
-				1000);
+				USBD480_CTRL_TIMEOUT);
 	if (result)
-		dev_dbg(&dev->udev->dev, "result = %d\n", result);
+		dev_dbg(dev->dev, "result = %d\n", result);
 						
-	return 0;	
+	return result;
+}
+
+static int usbd480_get_device_details(struct usbd480 *d)
+{
+	int result;
+
+	result = d->tp->get_details(d);
+	if (result)
+		return result;
+
+	if (!d->width || !d->height) {
+		dev_err(d->dev, "bad display size %ux%u\n", d->width, d->height);
+		return -EIO;
+	}
+
+	d->caps &= caps_mask;
+	/* pages are two frames apart, a page needs only the first */
+	d->pages = (d->memsize / (d->width * d->height * 2) + 1) / 2;
+	if (!d->pages) {
+		dev_err(d->dev, "%lu bytes of device memory don't hold a frame\n", d->memsize);
+		return -EIO;
+	}
+	if (d->pages < 2)
+		d->caps &= ~USBD480_CAP_PAGES;
+
+	dev_dbg(d->dev, "firmware %04x, serial %s, %u pages,%s%s\n", d->fw_version,
+		d->serial[0] ? d->serial : "none", d->pages,
+		d->caps & USBD480_CAP_PARTIAL ? " partial" : " full frames",
+		d->caps & USBD480_CAP_PAGES ? " flipping" : " single page");
+	return 0;
+}
+
+static int usbd480_set_brightness(struct usbd480 *d, unsigned int brightness)
+{
+	return d->tp->set_brightness(d, brightness);
+}
+
+static int usbd480_set_address(struct usbd480 *d, unsigned int addr)
+{
+	return d->tp->set_address(d, addr);
+}
+
+static int usbd480_set_frame_start_address(struct usbd480 *d, unsigned int addr)
+{
+	return d->tp->set_frame_start(d, addr);
+}
+
+/* write len bytes from src at the current address, a NULL src writes zeroes */
+static int usbd480_send_bulk(struct usbd480 *d, const unsigned char *src, unsigned int len)
+{
+	return d->tp->write(d, src, len);
+}
+
+/* runtime pm only applies to real devices */
+static int usbd480_autopm_get(struct usbd480 *d)
+{
+	return d->intf ? usb_autopm_get_interface(d->intf) : 0;
+}
+
+static void usbd480_autopm_put(struct usbd480 *d)
+{
+	if (d->intf)
+		usb_autopm_put_interface(d->intf);
 }
 
 static ssize_t show_brightness(struct device *dev, struct device_attribute *attr, char *buf)		
 {									
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usbd480 *d = usb_get_intfdata(intf);			
+	struct usbd480 *d = dev_get_drvdata(dev);			
 									
 	return sprintf(buf, "%d\n", d->brightness);			
 }		
 							
 static ssize_t set_brightness(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)	
 {								
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usbd480 *d = usb_get_intfdata(intf);			
+	struct usbd480 *d = dev_get_drvdata(dev);			
 	int brightness = simple_strtoul(buf, NULL, 10);			
+	int result;
 									
 	d->brightness = brightness;
+	d->brightness_set = 1;
 
-	usbd480_set_brightness(d, brightness);	
+	if (usbd480_autopm_get(d))
+		return -EIO;
+	result = usbd480_set_brightness(d, brightness);	
+	usbd480_autopm_put(d);
 						
-	return count;
+	return result ? result : count;
 }
 
 static ssize_t show_width(struct device *dev, struct device_attribute *attr, char *buf)		
 {									
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usbd480 *d = usb_get_intfdata(intf);	
+	struct usbd480 *d = dev_get_drvdata(dev);	
 									
 	return sprintf(buf, "%d\n", d->width);			
 }
 
 static ssize_t show_height(struct device *dev, struct device_attribute *attr, char *buf)		
 {									
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usbd480 *d = usb_get_intfdata(intf);	
+	struct usbd480 *d = dev_get_drvdata(dev);	
 									
 	return sprintf(buf, "%d\n", d->height);			
 }
 
 static ssize_t show_name(struct device *dev, struct device_attribute *attr, char *buf)		
 {						
-	struct usb_interface *intf = to_usb_interface(dev);		
-	struct usbd480 *d = usb_get_intfdata(intf);
+	struct usbd480 *d = dev_get_drvdata(dev);
 									
 	return sprintf(buf, "%s\n", d->device_name);			
 }
 
-static DEVICE_ATTR(brightness, S_IWUGO | S_IRUGO, show_brightness, set_brightness);
-static DEVICE_ATTR(width, S_IRUGO, show_width, NULL);
-static DEVICE_ATTR(height, S_IRUGO, show_height, NULL);
-static DEVICE_ATTR(name, S_IRUGO, show_name, NULL);
+static ssize_t show_first_frame_ms(struct device *dev, struct device_attribute *attr, char *buf)		
+{						
+	struct usbd480 *d = dev_get_drvdata(dev);
+									
+	return sprintf(buf, "%d\n", d->first_frame_ms);			
+}
 
-static void usbd480fb_work(struct work_struct *work)
+static ssize_t show_firmware(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	struct usbd480 *d =
-		container_of(work, struct usbd480, work.work);
-	int result;	
-	int sentsize;
-	int writeaddr;
-	int showaddr;
-
-	if(d->disp_page == 0)
-	{
-		writeaddr = 0;
-		showaddr = 0;
-		d->disp_page = 1;
-	}
-	else
-	{	
-		writeaddr = d->vmemsize;
-		showaddr = d->vmemsize;
-		d->disp_page = 0;
-	}
-
-	usbd480_set_address(d, writeaddr);
+	struct usbd480 *d = dev_get_drvdata(dev);
 
-	result = usb_bulk_msg(d->udev,
-				usb_sndbulkpipe(d->udev, 2),
-				d->vmem,
-				d->vmemsize,
-				&sentsize, 5000);
+	return sprintf(buf, "%04x\n", d->fw_version);
+}
 
-	usbd480_set_frame_start_address(d, showaddr);
+static ssize_t show_caps(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usbd480 *d = dev_get_drvdata(dev);
 
-	queue_delayed_work(d->wq, &d->work, USBD480_REFRESH_JIFFIES);
+	return sprintf(buf, "%s%s\n",
+		d->caps & USBD480_CAP_PARTIAL ? "partial " : "",
+		d->caps & USBD480_CAP_PAGES ? "pages" : "");
 }
 
-
-/*
-static long usbd480_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static ssize_t show_profile(struct device *dev, struct device_attribute *attr, char *buf)
 {
+	struct usbd480 *d = dev_get_drvdata(dev);
 
-	return 0;
+	return sprintf(buf, "%s\n", d->profile);
 }
 
-static struct file_operations usbd480_fops = {
-	.owner =	THIS_MODULE,
-//	.read =		usbd480_read,
-//	.write =	usbd480_write,
-	.unlocked_ioctl = usbd480_ioctl,
-//	.open =		usbd480_open,
-//	.release =	usbd480_release,
-};
+static DEVICE_ATTR(brightness, S_IWUGO | S_IRUGO, show_brightness, set_brightness);
+static DEVICE_ATTR(width, S_IRUGO, show_width, NULL);
+static DEVICE_ATTR(height, S_IRUGO, show_height, NULL);
+static DEVICE_ATTR(name, S_IRUGO, show_name, NULL);
+static DEVICE_ATTR(first_frame_ms, S_IRUGO, show_first_frame_ms, NULL);
+static DEVICE_ATTR(firmware, S_IRUGO, show_firmware, NULL);
+static DEVICE_ATTR(caps, S_IRUGO, show_caps, NULL);
+static DEVICE_ATTR(profile, S_IRUGO, show_profile, NULL);
 
-static struct usb_class_driver usbd480_class = {
-	.name =		"usbd480",
-	.fops =		&usbd480_fops,
-	.minor_base =	USBD480_MINOR_BASE,
-};
-*/
+static void usbd480_hist_add(struct usbd480 *d, int which, u64 us)
+{
+	struct usbd480_hist *h = &d->hist[which];
+	unsigned long flags;
+	int n = us ? min_t(int, ilog2(us), USBD480_HIST_BUCKETS - 1) : 0;
 
+	spin_lock_irqsave(&d->hist_lock, flags);
+	h->count++;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+	h->bucket[n]++;
+	spin_unlock_irqrestore(&d->hist_lock, flags);
+}
 
-#ifdef USBD480FB_PAN
-static int usbd480fb_pan_display(struct fb_var_screeninfo *var,
-			struct fb_info *info)
+static void usbd480_hist_since(struct usbd480 *d, int which, u64 start_ns)
 {
-    struct usbd480 *pusbd480fb = info->par;
-    unsigned int framestart;
-    int result;
-
-    if (var->xoffset != 0) /* not supported */
-	return -EINVAL;
-
-    if (var->yoffset + info->var.yres > info->var.yres_virtual)
-	return -EINVAL;
-    
-    framestart = (info->fix.line_length >> 1) * var->yoffset;
-
-    result = usb_control_msg(pusbd480fb->udev,
-		usb_sndctrlpipe(pusbd480fb->udev, 0),
-		USBD480_SET_FRAME_START_ADDRESS,
-		USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
-		framestart,
-		framestart>>16,
-		NULL,	
-		0,
-		1000);
-    
-    return 0;    
+	usbd480_hist_add(d, which, div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC));
 }
-#endif
-
-static struct fb_ops usbd480fb_ops = {
-	.owner		= THIS_MODULE,
-	.fb_read	= fb_sys_read,
-	.fb_write	= fb_sys_write,
-	.fb_fillrect	= sys_fillrect, 
-	.fb_copyarea	= sys_copyarea,	
-	.fb_imageblit	= sys_imageblit,
-	//.fb_ioctl	= usbd480fb_ioctl,
-	//.fb_mmap	= usbd480fb_mmap,
-	//.fb_pan_display = usbd480fb_pan_display,
-};
 
-static int usbd480_probe(struct usb_interface *interface, const struct usb_device_id *id)
+/* upper bound of the bucket holding the given percentile */
+static u64 usbd480_hist_percentile(const struct usbd480_hist *h, int pct)
 {
-	struct usb_device *udev = interface_to_usbdev(interface);
-	struct usbd480 *dev = NULL;
-	int retval = -ENOMEM;
-	signed long size;
-	unsigned long addr;
-	struct fb_info *info;
+	u64 want = div_u64(h->count * pct + 99, 100);
+	u64 seen = 0;
+	int n;
 
-	dev = kzalloc(sizeof(struct usbd480), GFP_KERNEL);
-	if (dev == NULL) {
-		retval = -ENOMEM;
-		dev_err(&interface->dev, "Out of memory\n");
-		goto error_dev;
+	for (n = 0; n < USBD480_HIST_BUCKETS; n++) {
+		seen += h->bucket[n];
+		if (seen >= want)
+			return min_t(u64, (2ULL << n) - 1, h->max);
 	}
+	return h->max;
+}
 
-	dev->udev = usb_get_dev(udev);
-	usb_set_intfdata (interface, dev);
+static int usbd480_latency_show(struct seq_file *m, void *v)
+{
+	struct usbd480 *d = m->private;
+	struct usbd480_hist *hist;
+	unsigned long flags;
+	int i, n;
 
-/*
-	retval = usb_register_dev(interface, &usbd480_class);
-	if (retval) {
-		err("Not able to get a minor for this device.");
+	hist = kmalloc_array(USBD480_LAT_COUNT, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
 		return -ENOMEM;
-	}
-*/
 
-	retval = device_create_file(&interface->dev, &dev_attr_brightness);
-	if (retval)
-		goto error_dev_attr;
-	retval = device_create_file(&interface->dev, &dev_attr_width);
-	if (retval)
-		goto error_dev_attr;
-	retval = device_create_file(&interface->dev, &dev_attr_height);
-	if (retval)
-		goto error_dev_attr;
-	retval = device_create_file(&interface->dev, &dev_attr_name);
-	if (retval)
-		goto error_dev_attr;
+	spin_lock_irqsave(&d->hist_lock, flags);
+	memcpy(hist, d->hist, sizeof(d->hist));
+	spin_unlock_irqrestore(&d->hist_lock, flags);
 
-	dev_info(&interface->dev, "USBD480 attached\n");
-	//printk(KERN_INFO "usbd480fb: USBD480 connected\n");
+	seq_printf(m, "%-18s %10s %10s %10s %10s %10s %10s\n", "phase (us)",
+		"count", "mean", "p50", "p90", "p99", "max");
+	for (i = 0; i < USBD480_LAT_COUNT; i++) {
+		struct usbd480_hist *h = &hist[i];
 
-	usbd480_get_device_details(dev);
-	dev->vmemsize = dev->width*dev->height*2;
-	dev->vmem = NULL;
+		seq_printf(m, "%-18s %10llu %10llu %10llu %10llu %10llu %10llu\n",
+			usbd480_lat_names[i], h->count,
+			h->count ? div64_u64(h->sum, h->count) : 0,
+			usbd480_hist_percentile(h, 50),
+			usbd480_hist_percentile(h, 90),
+			usbd480_hist_percentile(h, 99),
+			h->max);
+	}
 
-	if (!(dev->vmem = (void *)__get_free_pages(GFP_KERNEL, USBD480_VIDEOMEMORDER))) {
-		printk(KERN_ERR ": can't allocate vmem buffer");
-		retval = -ENOMEM;
-		goto error_vmem;
+	for (i = 0; i < USBD480_LAT_COUNT; i++) {
+		seq_printf(m, "\n%s\n", usbd480_lat_names[i]);
+		for (n = 0; n < USBD480_HIST_BUCKETS; n++) {
+			if (!hist[i].bucket[n])
+				continue;
+			seq_printf(m, "  %10llu - %10llu: %u\n",
+				n ? 1ULL << n : 0, (2ULL << n) - 1, hist[i].bucket[n]);
+		}
 	}
 
-	size = PAGE_SIZE * (1 << USBD480_VIDEOMEMORDER);
-	addr = (unsigned long)dev->vmem;
+	kfree(hist);
+	return 0;
+}
 
-	while (size > 0) {
-	    SetPageReserved(virt_to_page((void*)addr));
-	    addr += PAGE_SIZE;
-	    size -= PAGE_SIZE;
-	}
+static int usbd480_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, usbd480_latency_show, inode->i_private);
+}
 
-	dev->vmem_phys = virt_to_phys(dev->vmem);
-	memset(dev->vmem, 0, dev->vmemsize);
+/* any write clears the histograms */
+static ssize_t usbd480_latency_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = ((struct seq_file *)file->private_data)->private;
+	unsigned long flags;
 
-	info = framebuffer_alloc(0, NULL);
-	if (!info)
-	{
-		printk("error: framebuffer_alloc\n");
-		goto error_fballoc;
-	}
+	spin_lock_irqsave(&d->hist_lock, flags);
+	memset(d->hist, 0, sizeof(d->hist));
+	spin_unlock_irqrestore(&d->hist_lock, flags);
+	return count;
+}
 
-	info->screen_base = (char __iomem *) dev->vmem;
-	info->screen_size = dev->vmemsize;
-	info->fbops = &usbd480fb_ops;
+static const struct file_operations usbd480_latency_fops = {
+	.owner =	THIS_MODULE,
+	.open =		usbd480_latency_open,
+	.read =		seq_read,
+	.write =	usbd480_latency_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
 
-	info->fix.type =	FB_TYPE_PACKED_PIXELS;
+/*
+ * Writer side of the stats page protocol described in usbd480fb.h.
+ */
+static struct usbd480_stats *usbd480_stats_begin(struct usbd480 *d, unsigned long *flags)
+{
+	spin_lock_irqsave(&d->hist_lock, *flags);
+	WRITE_ONCE(d->stats->seq, d->stats->seq + 1);
+	smp_wmb();
+	return d->stats;
+}
+
+static void usbd480_stats_end(struct usbd480 *d, unsigned long flags)
+{
+	smp_wmb();
+	WRITE_ONCE(d->stats->seq, d->stats->seq + 1);
+	spin_unlock_irqrestore(&d->hist_lock, flags);
+}
+
+static void usbd480_stats_frame(struct usbd480 *d, unsigned int len, u64 busy_ns)
+{
+	struct usbd480_hist *h = &d->hist[USBD480_LAT_DAMAGE_TO_VISIBLE];
+	struct usbd480_stats *st;
+	unsigned long flags;
+
+	st = usbd480_stats_begin(d, &flags);
+	st->frames++;
+	st->bytes += len;
+	st->bytes_saved += d->vmemsize - len;
+	st->busy_ns += busy_ns;
+	st->last_flip_ns = ktime_get_ns();
+	st->last_scan_ns = d->scan_ns;
+	st->latency_p50_us = usbd480_hist_percentile(h, 50);
+	st->latency_p99_us = usbd480_hist_percentile(h, 99);
+	st->latency_max_us = h->max;
+	usbd480_stats_end(d, flags);
+}
+
+static void usbd480_stats_error(struct usbd480 *d, int dropped)
+{
+	struct usbd480_stats *st;
+	unsigned long flags;
+
+	st = usbd480_stats_begin(d, &flags);
+	st->errors = ++d->errors;
+	if (dropped)
+		st->dropped++;
+	usbd480_stats_end(d, flags);
+}
+
+/* called every refresh, updates the rates once a second */
+static void usbd480_stats_tick(struct usbd480 *d, int skipped)
+{
+	struct usbd480_stats *st;
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+	u64 elapsed = now - d->rate_ns;
+
+	if (!skipped && elapsed < NSEC_PER_SEC)
+		return;
+
+	st = usbd480_stats_begin(d, &flags);
+	if (skipped)
+		st->skipped++;
+	if (elapsed >= NSEC_PER_SEC) {
+		st->fps_x100 = div64_u64((st->frames - d->rate_frames) * 100 * NSEC_PER_SEC, elapsed);
+		st->bytes_per_sec = div64_u64((st->bytes - d->rate_bytes) * NSEC_PER_SEC, elapsed);
+		d->rate_frames = st->frames;
+		d->rate_bytes = st->bytes;
+		d->rate_ns = now;
+	}
+	usbd480_stats_end(d, flags);
+}
+
+static ssize_t usbd480_stats_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct usbd480 *d = dev_get_drvdata(kobj_to_dev(kobj));
+	struct usbd480_stats st;
+	unsigned long flags;
+
+	if (off >= sizeof(st))
+		return 0;
+	count = min_t(size_t, count, sizeof(st) - off);
+
+	spin_lock_irqsave(&d->hist_lock, flags);
+	st = *d->stats;
+	spin_unlock_irqrestore(&d->hist_lock, flags);
+
+	memcpy(buf, (char *)&st + off, count);
+	return count;
+}
+
+static int usbd480_stats_mmap(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, struct vm_area_struct *vma)
+{
+	struct usbd480 *d = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(d->stats));
+}
+
+static struct bin_attribute bin_attr_stats = {
+	.attr = { .name = "stats", .mode = S_IRUGO },
+	.size = PAGE_SIZE,
+	.read = usbd480_stats_read,
+	.mmap = usbd480_stats_mmap,
+};
+
+/*
+ * Damage heatmap, counts per tile how often it changed and how often it
+ * was sent. Read from debugfs as struct usbd480_heatmap followed by the
+ * damaged and the uploaded counts, row by row.
+ */
+static int usbd480_alloc_heatmap(struct usbd480 *d)
+{
+	unsigned int n;
+
+	d->tiles_x = DIV_ROUND_UP(d->width, USBD480_TILE);
+	d->tiles_y = DIV_ROUND_UP(d->height, USBD480_TILE);
+	n = d->tiles_x * d->tiles_y;
+
+	d->tile_dirty = bitmap_zalloc(n, GFP_KERNEL);
+	d->tile_damaged = kcalloc(n, sizeof(u32), GFP_KERNEL);
+	d->tile_uploaded = kcalloc(n, sizeof(u32), GFP_KERNEL);
+	if (!d->tile_dirty || !d->tile_damaged || !d->tile_uploaded)
+		return -ENOMEM;
+	return 0;
+}
+
+/* mark the tiles of row y that differ between the old and new contents */
+static void usbd480_mark_tiles(struct usbd480 *d, int y, const unsigned char *src,
+		const unsigned char *dst)
+{
+	unsigned int tile = (y / USBD480_TILE) * d->tiles_x;
+	unsigned int x;
+
+	for (x = 0; x < d->tiles_x; x++) {
+		unsigned int off = x * USBD480_TILE * 2;
+		unsigned int len = min_t(unsigned int, USBD480_TILE * 2, d->width * 2 - off);
+
+		if (!d->shadow_valid || memcmp(src + off, dst + off, len))
+			__set_bit(tile + x, d->tile_dirty);
+	}
+}
+
+static void usbd480_count_damage(struct usbd480 *d)
+{
+	unsigned int n;
+
+	for_each_set_bit(n, d->tile_dirty, d->tiles_x * d->tiles_y)
+		d->tile_damaged[n]++;
+	bitmap_zero(d->tile_dirty, d->tiles_x * d->tiles_y);
+	d->heatmap_frames++;
+}
+
+static void usbd480_count_upload(struct usbd480 *d, int first, int last)
+{
+	unsigned int n = (first / USBD480_TILE) * d->tiles_x;
+	unsigned int end = (last / USBD480_TILE + 1) * d->tiles_x;
+
+	for (; n < end; n++)
+		d->tile_uploaded[n]++;
+}
+
+static ssize_t usbd480_heatmap_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = file->private_data;
+	struct usbd480_heatmap *hm;
+	unsigned int n = d->tiles_x * d->tiles_y;
+	size_t size = sizeof(*hm) + 2 * n * sizeof(u32);
+	u32 *counts;
+	ssize_t ret;
+
+	hm = kmalloc(size, GFP_KERNEL);
+	if (!hm)
+		return -ENOMEM;
+	counts = (u32 *)(hm + 1);
+
+	mutex_lock(&d->mem_lock);
+	hm->tile_size = USBD480_TILE;
+	hm->tiles_x = d->tiles_x;
+	hm->tiles_y = d->tiles_y;
+	hm->frames = d->heatmap_frames;
+	memcpy(counts, d->tile_damaged, n * sizeof(u32));
+	memcpy(counts + n, d->tile_uploaded, n * sizeof(u32));
+	mutex_unlock(&d->mem_lock);
+
+	ret = simple_read_from_buffer(buf, count, ppos, hm, size);
+	kfree(hm);
+	return ret;
+}
+
+/* any write starts counting from zero */
+static ssize_t usbd480_heatmap_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = file->private_data;
+	unsigned int n = d->tiles_x * d->tiles_y;
+
+	mutex_lock(&d->mem_lock);
+	memset(d->tile_damaged, 0, n * sizeof(u32));
+	memset(d->tile_uploaded, 0, n * sizeof(u32));
+	d->heatmap_frames = 0;
+	mutex_unlock(&d->mem_lock);
+	return count;
+}
+
+static const struct file_operations usbd480_heatmap_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.read =		usbd480_heatmap_read,
+	.write =	usbd480_heatmap_write,
+	.llseek =	default_llseek,
+};
+
+/* the frame of the framebuffer panned to */
+static unsigned char *usbd480_front(struct usbd480 *d)
+{
+	return d->vmem + d->yoffset * d->width * 2;
+}
+
+static int usbd480_take_scroll(struct usbd480 *d)
+{
+	unsigned long flags;
+	int n;
+
+	spin_lock_irqsave(&d->ops_lock, flags);
+	n = max(d->scroll_pending, 0);
+	d->scroll_pending = 0;
+	d->scroll_delta = 0;
+	spin_unlock_irqrestore(&d->ops_lock, flags);
+	return n;
+}
+
+/*
+ * Take the rows of the shown frame the drawing ops changed. Returns
+ * nonzero when those are all the changes there are.
+ */
+static int usbd480_take_ops_damage(struct usbd480 *d, int *from, int *to)
+{
+	unsigned long flags;
+	int trusted;
+
+	spin_lock_irqsave(&d->ops_lock, flags);
+	trusted = !d->ops_full && !atomic_read(&d->mapped);
+	*from = max_t(int, d->ops_first - (int)d->yoffset, 0);
+	*to = min_t(int, d->ops_last - (int)d->yoffset, d->height - 1);
+	d->ops_first = d->height * 2;
+	d->ops_last = -1;
+	d->ops_full = 0;
+	spin_unlock_irqrestore(&d->ops_lock, flags);
+	return trusted;
+}
+
+/*
+ * Pull the rows of the framebuffer that differ from the last sent frame
+ * into the shadow copy. Returns the number of changed rows, their span is
+ * returned in first and last. When a client reported its damage only
+ * those rows are compared, anything else it changed waits for the next
+ * run. When nothing has the framebuffer mapped only the rows the drawing
+ * ops changed are.
+ */
+static int usbd480_find_damage(struct usbd480 *d, int *first, int *last)
+{
+	unsigned int pitch = d->width * 2;
+	unsigned char *front = usbd480_front(d);
+	int from = 0, to = d->height - 1;
+	int ofrom, oto, trusted;
+	int y;
+	int changed = 0;
+
+	*first = d->height;
+	*last = -1;
+
+	d->scan_ns = ktime_get_ns();
+	trusted = usbd480_take_ops_damage(d, &ofrom, &oto);
+	if (!d->shadow_valid)
+		;
+	else if (d->hint_last >= 0) {
+		from = d->hint_first;
+		to = d->hint_last;
+		if (trusted && ofrom <= oto) {
+			from = min(from, ofrom);
+			to = max(to, oto);
+		}
+	} else if (trusted) {
+		from = ofrom;
+		to = oto;
+	}
+	d->hint_last = -1;
+	if (d->stale_last >= 0) {
+		from = min(from, d->stale_first);
+		to = max(to, d->stale_last);
+	}
+
+	for (y = from; y <= to; y++) {
+		unsigned char *src = front + y * pitch;
+		unsigned char *dst = d->shadow + y * pitch;
+
+		if (d->shadow_valid && (y < d->stale_first || y > d->stale_last) &&
+		    !memcmp(src, dst, pitch))
+			continue;
+
+		usbd480_mark_tiles(d, y, src, dst);
+		memcpy(dst, src, pitch);
+		if (*first > y)
+			*first = y;
+		*last = y;
+		changed++;
+	}
+
+	d->stale_last = -1;
+
+	if (changed) {
+		usbd480_count_damage(d);
+		trace_usbd480_damage(d->dev, *first, *last, changed);
+	}
+	return changed;
+}
+
+/*
+ * Free the shadow and the transfer buffers of a panel nobody has drawn on
+ * for a while. A hash per row is kept to notice when that changes.
+ */
+static void usbd480_release_buffers(struct usbd480 *d)
+{
+	unsigned int pitch = d->width * 2;
+	int y;
+
+	d->row_hash = kmalloc_array(d->height, sizeof(u32), GFP_KERNEL);
+	if (!d->row_hash)
+		return;
+
+	for (y = 0; y < d->height; y++)
+		d->row_hash[y] = jhash(d->shadow + y * pitch, pitch, 0);
+
+	vfree(d->shadow);
+	d->shadow = NULL;
+	usbd480_free_xfers(d);
+	dev_dbg(d->dev, "idle, buffers released\n");
+}
+
+/*
+ * Damage check while the buffers are released. The rows are picked like
+ * in usbd480_find_damage(), so with nothing mapped only the rows the
+ * drawing ops touched are hashed. A matching hash is only a hint, on any
+ * change the buffers come back and the whole frame is sent, which also
+ * repairs a row whose change a hash collision hid. Returns nonzero when
+ * there is a frame to send.
+ */
+static int usbd480_find_idle_damage(struct usbd480 *d, int *first, int *last)
+{
+	unsigned int pitch = d->width * 2;
+	int from = 0, to = d->height - 1;
+	int ofrom, oto, trusted;
+	int y;
+	int changed = 0;
+	unsigned long flags;
+
+	*first = d->height;
+	*last = -1;
+
+	d->scan_ns = ktime_get_ns();
+	trusted = usbd480_take_ops_damage(d, &ofrom, &oto);
+	if (d->hint_last >= 0) {
+		from = d->hint_first;
+		to = d->hint_last;
+		if (trusted && ofrom <= oto) {
+			from = min(from, ofrom);
+			to = max(to, oto);
+		}
+	} else if (trusted) {
+		from = ofrom;
+		to = oto;
+	}
+	d->hint_last = -1;
+
+	for (y = from; y <= to; y++) {
+		if (jhash(usbd480_front(d) + y * pitch, pitch, 0) == d->row_hash[y])
+			continue;
+		/* the old contents are gone, count the whole row */
+		bitmap_set(d->tile_dirty, (y / USBD480_TILE) * d->tiles_x, d->tiles_x);
+		if (*first > y)
+			*first = y;
+		*last = y;
+		changed++;
+	}
+
+	/* after a reset the device has nothing, send it all */
+	if (!changed && !d->pages_stale)
+		return 0;
+	if (changed) {
+		usbd480_count_damage(d);
+		trace_usbd480_damage(d->dev, *first, *last, changed);
+	}
+
+	d->shadow = vmalloc(d->vmemsize);
+	if (d->shadow && usbd480_alloc_xfers(d)) {
+		vfree(d->shadow);
+		d->shadow = NULL;
+	}
+	if (!d->shadow) {
+		/* the rows taken above are lost, look at all of them next time */
+		spin_lock_irqsave(&d->ops_lock, flags);
+		d->ops_full = 1;
+		spin_unlock_irqrestore(&d->ops_lock, flags);
+		return 0;
+	}
+
+	memcpy(d->shadow, usbd480_front(d), d->vmemsize);
+	kfree(d->row_hash);
+	d->row_hash = NULL;
+	d->pages_stale = 2;
+	return 1;
+}
+
+/*
+ * Time a bulk transfer of len bytes should take at worst on this link,
+ * so a stuck transfer is noticed in about a frame time rather than seconds.
+ */
+static unsigned int usbd480_bulk_timeout(struct usbd480 *d, unsigned int len)
+{
+	unsigned int rate;
+
+	if (d->udev->speed >= USB_SPEED_HIGH)
+		rate = USBD480_BULK_RATE_HS;
+	else
+		rate = USBD480_BULK_RATE_FS;
+
+	return USBD480_BULK_TIMEOUT_MARGIN + len / rate;
+}
+
+/*
+ * Stream len bytes to the bulk endpoint, copying into one urb buffer
+ * while the other is on the wire. A NULL src sends zeroes. Every urb but
+ * the last is whole packets, so there are no short packets or zero length
+ * packets before the end.
+ */
+static int usbd480_usb_send_bulk(struct usbd480 *d, const unsigned char *src, unsigned int len)
+{
+	int result = 0;
+	int i = 0;
+	int n;
+
+	while (len) {
+		struct usbd480_xfer *x = &d->xfer[i];
+		unsigned int chunk = min(len, d->chunk);
+
+		if (x->busy) {
+			x->busy = 0;
+			result = usbd480_wait_urb(x->urb, &x->done,
+				usbd480_bulk_timeout(d, x->urb->transfer_buffer_length));
+			if (result)
+				break;
+		}
+
+		if (src)
+			memcpy(x->urb->transfer_buffer, src, chunk);
+		else
+			memset(x->urb->transfer_buffer, 0, chunk);
+		x->urb->transfer_buffer_length = chunk;
+		reinit_completion(&x->done);
+
+		result = usbd480_submit_urb(d, x->urb);
+		if (result)
+			break;
+		x->busy = 1;
+
+		if (src)
+			src += chunk;
+		len -= chunk;
+		i = (i + 1) % USBD480_XFER_URBS;
+	}
+
+	for (n = 0; n < USBD480_XFER_URBS; n++) {
+		struct usbd480_xfer *x = &d->xfer[n];
+		int r;
+
+		if (!x->busy)
+			continue;
+		x->busy = 0;
+		r = usbd480_wait_urb(x->urb, &x->done,
+			usbd480_bulk_timeout(d, x->urb->transfer_buffer_length));
+		if (!result)
+			result = r;
+	}
+
+	return result;
+}
+
+/*
+ * Send pinned user pages as they are, with one scatter-gather urb. The
+ * host controller has to take sg lists, and unless it takes any element
+ * size the data has to start packet aligned. Returns -EOPNOTSUPP when
+ * that is not the case so the caller can copy instead.
+ */
+static int usbd480_usb_send_pages(struct usbd480 *d, struct page **pages,
+		unsigned int npages, unsigned int offset, unsigned int len)
+{
+	struct usb_bus *bus = d->udev->bus;
+	unsigned int pipe = d->bulk_pipe;
+	struct completion done;
+	struct sg_table sgt;
+	struct urb *urb;
+	int result;
+
+	if (!bus->sg_tablesize || npages > bus->sg_tablesize ||
+	    (!bus->no_sg_constraint && offset % d->maxpacket))
+		return -EOPNOTSUPP;
+
+	result = sg_alloc_table_from_pages(&sgt, pages, npages, offset, len, GFP_KERNEL);
+	if (result)
+		return result;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	init_completion(&done);
+	usb_fill_bulk_urb(urb, d->udev, pipe, NULL, len, usbd480_urb_complete, &done);
+	urb->sg = sgt.sgl;
+	urb->num_sgs = sgt.orig_nents;
+
+	result = usbd480_submit_urb(d, urb);
+	if (!result)
+		result = usbd480_wait_urb(urb, &done, usbd480_bulk_timeout(d, len));
+	usb_free_urb(urb);
+out:
+	sg_free_table(&sgt);
+	return result;
+}
+
+static int usbd480_usb_clear_halt(struct usbd480 *d)
+{
+	return usb_clear_halt(d->udev, d->bulk_pipe);
+}
+
+static void usbd480_usb_reset(struct usbd480 *d)
+{
+	/* pre_reset() and post_reset() take it from here */
+	usb_queue_reset_device(d->intf);
+}
+
+static const struct usbd480_transport usbd480_usb_transport = {
+	.name =			"usb",
+	.get_details =		usbd480_usb_get_details,
+	.set_address =		usbd480_usb_set_address,
+	.set_frame_start =	usbd480_usb_set_frame_start,
+	.set_brightness =	usbd480_usb_set_brightness,
+	.write =		usbd480_usb_send_bulk,
+	.write_pages =		usbd480_usb_send_pages,
+	.clear_halt =		usbd480_usb_clear_halt,
+	.reset =		usbd480_usb_reset,
+};
+
+/*
+ * Fake transport, keeps the device memory in a vmalloc'd buffer and
+ * accounts for the time a command or transfer would spend on the link.
+ * Each flip is checked against the shadow, which holds what the driver
+ * meant to put on screen.
+ */
+static u64 usbd480_fake_wire(struct usbd480_fake *f, unsigned int len)
+{
+	u64 ns = (u64)max(fake_latency, 0) * NSEC_PER_USEC;
+
+	if (len && fake_bandwidth > 0)
+		ns += div64_u64((u64)len * NSEC_PER_SEC, (u64)fake_bandwidth * 1024);
+
+	f->commands++;
+	f->bytes += len;
+	f->wire_ns += ns;
+	return ns;
+}
+
+static void usbd480_fake_sleep(u64 ns)
+{
+	if (fake_realtime && ns)
+		fsleep(div_u64(ns, NSEC_PER_USEC));
+}
+
+static int usbd480_fake_get_details(struct usbd480 *d)
+{
+	struct usbd480_fake *f = d->fake;
+	unsigned long pagesize;
+
+	if (fake_width <= 0 || fake_height <= 0)
+		return -EINVAL;
+
+	/* room for both update pages and the splash page, see usbd480_show_splash() */
+	pagesize = fake_width * fake_height * 2;
+	if ((USBD480_SPLASH_PAGE * 2 + 1) * pagesize > USBD480_FAKE_MEM_SIZE) {
+		dev_err(d->dev, "fake panel %dx%d does not fit in device memory\n",
+			fake_width, fake_height);
+		return -EINVAL;
+	}
+
+	f->mem = vzalloc(USBD480_FAKE_MEM_SIZE);
+	if (!f->mem)
+		return -ENOMEM;
+	f->memsize = USBD480_FAKE_MEM_SIZE;
+
+	d->width = fake_width;
+	d->height = fake_height;
+	strscpy(d->device_name, "USBD480-FAKE", sizeof(d->device_name));
+	d->caps = USBD480_CAP_ALL;
+	d->memsize = f->memsize;
+	return 0;
+}
+
+static int usbd480_fake_set_address(struct usbd480 *d, unsigned int addr)
+{
+	struct usbd480_fake *f = d->fake;
+	u64 ns;
+
+	mutex_lock(&f->lock);
+	f->addr = addr;
+	ns = usbd480_fake_wire(f, 0);
+	mutex_unlock(&f->lock);
+
+	usbd480_fake_sleep(ns);
+	return 0;
+}
+
+static int usbd480_fake_set_frame_start(struct usbd480 *d, unsigned int addr)
+{
+	struct usbd480_fake *f = d->fake;
+	unsigned long off = (unsigned long)addr * 2;
+	u64 ns;
+
+	if (off + d->vmemsize > f->memsize)
+		return -EINVAL;
+
+	mutex_lock(&f->lock);
+	f->frame_start = addr;
+	f->flips++;
+	/* the clear and the splash at probe come before there is a shadow */
+	if (d->shadow && d->shadow_valid && !d->rotate &&
+	    memcmp(f->mem + off, d->shadow, d->vmemsize)) {
+		if (!f->mismatches)
+			dev_warn(d->dev, "fake: page at %u differs from the shadow\n", addr);
+		f->mismatches++;
+	}
+	ns = usbd480_fake_wire(f, 0);
+	mutex_unlock(&f->lock);
+
+	usbd480_fake_sleep(ns);
+	return 0;
+}
+
+static int usbd480_fake_set_brightness(struct usbd480 *d, unsigned int brightness)
+{
+	struct usbd480_fake *f = d->fake;
+	u64 ns;
+
+	mutex_lock(&f->lock);
+	f->brightness = brightness;
+	ns = usbd480_fake_wire(f, 0);
+	mutex_unlock(&f->lock);
+
+	usbd480_fake_sleep(ns);
+	return 0;
+}
+
+static int usbd480_fake_write(struct usbd480 *d, const unsigned char *src, unsigned int len)
+{
+	struct usbd480_fake *f = d->fake;
+	unsigned long off;
+	u64 ns;
+
+	mutex_lock(&f->lock);
+	if (f->fail_writes) {
+		f->fail_writes--;
+		mutex_unlock(&f->lock);
+		return f->fail_error;
+	}
+
+	off = (unsigned long)f->addr * 2;
+	if (off + len > f->memsize) {
+		mutex_unlock(&f->lock);
+		return -EINVAL;
+	}
+
+	if (src)
+		memcpy(f->mem + off, src, len);
+	else
+		memset(f->mem + off, 0, len);
+	/* the device advances the address as data comes in */
+	f->addr += len / 2;
+	ns = usbd480_fake_wire(f, len);
+	mutex_unlock(&f->lock);
+
+	usbd480_fake_sleep(ns);
+	return 0;
+}
+
+static int usbd480_fake_clear_halt(struct usbd480 *d)
+{
+	struct usbd480_fake *f = d->fake;
+	u64 ns;
+
+	mutex_lock(&f->lock);
+	f->halts++;
+	ns = usbd480_fake_wire(f, 0);
+	mutex_unlock(&f->lock);
+
+	usbd480_fake_sleep(ns);
+	return 0;
+}
+
+/* what a port reset does to the device, followed by post_reset() */
+static void usbd480_fake_reset(struct usbd480 *d)
+{
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	memset(f->mem, 0, f->memsize);
+	f->addr = 0;
+	f->frame_start = 0;
+	f->resets++;
+	mutex_unlock(&f->lock);
+
+	d->pages_stale = 2;
+	d->scrolling = 0;
+	d->retries = 0;
+	queue_delayed_work(d->wq, &d->work, 0);
+}
+
+static const struct usbd480_transport usbd480_fake_transport = {
+	.name =			"fake",
+	.get_details =		usbd480_fake_get_details,
+	.set_address =		usbd480_fake_set_address,
+	.set_frame_start =	usbd480_fake_set_frame_start,
+	.set_brightness =	usbd480_fake_set_brightness,
+	.write =		usbd480_fake_write,
+	.clear_halt =		usbd480_fake_clear_halt,
+	.reset =		usbd480_fake_reset,
+};
+
+static int usbd480_fake_stats_show(struct seq_file *m, void *v)
+{
+	struct usbd480 *d = m->private;
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	seq_printf(m, "commands: %llu\n", f->commands);
+	seq_printf(m, "bytes: %llu\n", f->bytes);
+	seq_printf(m, "wire_ns: %llu\n", f->wire_ns);
+	seq_printf(m, "flips: %llu\n", f->flips);
+	seq_printf(m, "mismatches: %llu\n", f->mismatches);
+	seq_printf(m, "halts: %llu\n", f->halts);
+	seq_printf(m, "resets: %llu\n", f->resets);
+	seq_printf(m, "frame_start: %u\n", f->frame_start);
+	seq_printf(m, "brightness: %u\n", f->brightness);
+	mutex_unlock(&f->lock);
+	return 0;
+}
+
+static int usbd480_fake_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, usbd480_fake_stats_show, inode->i_private);
+}
+
+/* any write clears the counters */
+static ssize_t usbd480_fake_stats_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = ((struct seq_file *)file->private_data)->private;
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	f->commands = 0;
+	f->bytes = 0;
+	f->wire_ns = 0;
+	f->flips = 0;
+	f->mismatches = 0;
+	f->halts = 0;
+	f->resets = 0;
+	mutex_unlock(&f->lock);
+	return count;
+}
+
+static const struct file_operations usbd480_fake_stats_fops = {
+	.owner =	THIS_MODULE,
+	.open =		usbd480_fake_stats_open,
+	.read =		seq_read,
+	.write =	usbd480_fake_stats_write,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* the page currently on screen, in the framebuffer's RGB565 layout */
+static ssize_t usbd480_fake_frame_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = file->private_data;
+	struct usbd480_fake *f = d->fake;
+	ssize_t ret;
+
+	mutex_lock(&f->lock);
+	ret = simple_read_from_buffer(buf, count, ppos,
+		f->mem + (unsigned long)f->frame_start * 2, d->vmemsize);
+	mutex_unlock(&f->lock);
+	return ret;
+}
+
+static const struct file_operations usbd480_fake_frame_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.read =		usbd480_fake_frame_read,
+	.llseek =	default_llseek,
+};
+
+static void usbd480_first_frame(struct usbd480 *d)
+{
+	if (d->first_frame_ms >= 0)
+		return;
+
+	d->first_frame_ms = ktime_ms_delta(ktime_get(), d->probe_time);
+	dev_info(d->dev, "first frame on screen %d ms after probe\n",
+		d->first_frame_ms);
+}
+
+/*
+ * Blank page 0 and show it, so the panel has a defined picture until
+ * someone opens the framebuffer and the memory for it is allocated.
+ */
+static void usbd480_clear(struct usbd480 *d)
+{
+	int result;
+
+	result = usbd480_set_address(d, 0);
+	if (!result)
+		result = usbd480_send_bulk(d, NULL, d->vmemsize);
+	if (!result && (d->caps & USBD480_CAP_PAGES))
+		result = usbd480_set_frame_start_address(d, 0);
+	if (result) {
+		dev_warn(d->dev, "clearing display failed: %d\n", result);
+		return;
+	}
+
+	usbd480_first_frame(d);
+}
+
+/* a whole frame upside down and right to left, into rotbuf */
+static void usbd480_rotate_frame(struct usbd480 *d, const unsigned char *frame)
+{
+	const u16 *src = (const u16 *)frame;
+	u16 *dst = (u16 *)d->rotbuf;
+	unsigned int n = d->width * d->height;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = src[n - 1 - i];
+}
+
+/*
+ * Put the splash image into its own page of device memory and show it
+ * while the framebuffer is still being set up. The image is kept until
+ * the framebuffer is opened and becomes its initial contents, so the
+ * first update sends the same picture instead of a black frame.
+ */
+static int usbd480_show_splash(struct usbd480 *d)
+{
+	const struct firmware *fw;
+	const unsigned char *src;
+	unsigned int addr = USBD480_SPLASH_PAGE * d->vmemsize;
+	int result;
+
+	result = request_firmware(&fw, splash, d->dev);
+	if (result) {
+		dev_warn(d->dev, "can't load splash %s: %d\n", splash, result);
+		return result;
+	}
+
+	if (fw->size != d->vmemsize) {
+		dev_warn(d->dev, "splash %s is %zu bytes, expected %lu\n",
+			splash, fw->size, d->vmemsize);
+		result = -EINVAL;
+		goto out;
+	}
+
+	/* the image is the right way up, like the framebuffer */
+	src = fw->data;
+	if (d->rotate) {
+		usbd480_rotate_frame(d, src);
+		src = d->rotbuf;
+	}
+
+	result = usbd480_set_address(d, addr);
+	if (!result)
+		result = usbd480_send_bulk(d, src, fw->size);
+	if (!result)
+		result = usbd480_set_frame_start_address(d, addr);
+	if (result) {
+		dev_warn(d->dev, "splash upload failed: %d\n", result);
+		goto out;
+	}
+
+	usbd480_first_frame(d);
+	d->splash_fw = fw;
+	return 0;
+out:
+	release_firmware(fw);
+	return result;
+}
+
+/*
+ * Device side scrolling. Each page is followed by a frame of unused
+ * device memory. A scroll up by n rows moves the frame start n rows into
+ * it and only the rows that differ from the moved frame are sent,
+ * written there before they are shown. Further frames go to the shown
+ * page in place until the room runs out, then page flipping resumes with
+ * two full frames.
+ */
+static void usbd480_scroll_end(struct usbd480 *d)
+{
+	if (!d->scrolling)
+		return;
+	d->scrolling = 0;
+	d->scroll_moved = 0;
+	d->pages_stale = 2;
+}
+
+/* nonzero when more rows of the shown frame moved up by n than stayed */
+static int usbd480_scroll_matches(struct usbd480 *d, int n)
+{
+	unsigned int pitch = d->width * 2;
+	unsigned char *front = usbd480_front(d);
+	int moved = 0, kept = 0;
+	int y;
+
+	for (y = 0; y < d->height - n; y++) {
+		if (!memcmp(front + y * pitch, d->shadow + (y + n) * pitch, pitch))
+			moved++;
+		else if (!memcmp(front + y * pitch, d->shadow + y * pitch, pitch))
+			kept++;
+	}
+	return moved > kept;
+}
+
+/* move the shadow like the device will, or stop scrolling */
+static void usbd480_scroll(struct usbd480 *d, int n)
+{
+	unsigned int pitch = d->width * 2;
+	unsigned int base = (!d->disp_page) * d->vmemsize;
+	unsigned long flags;
+	unsigned int start;
+
+	if (d->pages_stale || !d->shadow_valid || d->rotate || d->full_frames ||
+	    (d->caps & USBD480_CAP_ALL) != USBD480_CAP_ALL) {
+		usbd480_scroll_end(d);
+		return;
+	}
+	if (!n)
+		return;
+
+	start = d->scrolling ? d->scroll_start : base;
+	if (n >= d->height || start - base + (n + d->height) * d->width > d->vmemsize) {
+		usbd480_scroll_end(d);
+		return;
+	}
+
+	/* the drawing ops only suggest a scroll, the frame has to show it */
+	if (!usbd480_scroll_matches(d, n))
+		return;
+
+	memmove(d->shadow, d->shadow + n * pitch, (d->height - n) * pitch);
+	d->stale_first = d->height - n;
+	d->stale_last = d->height - 1;
+	d->scroll_start = start + n * d->width;
+	d->scroll_moved += n;
+	d->scrolling = 1;
+	/* rows the ops left alone moved on the device too */
+	d->hint_last = -1;
+	spin_lock_irqsave(&d->ops_lock, flags);
+	d->ops_full = 1;
+	spin_unlock_irqrestore(&d->ops_lock, flags);
+}
+
+/* rows first to last of the shown page in place, then the frame start */
+static int usbd480_send_scrolled(struct usbd480 *d, int first, int last)
+{
+	unsigned int pitch = d->width * 2;
+	unsigned int len = 0;
+	u64 start = ktime_get_ns();
+	int result = 0;
+
+	trace_usbd480_frame_plan(d->dev, !d->disp_page, first, last,
+		last >= first ? (last - first + 1) * pitch : 0, 1, d->damage_ns);
+
+	if (last >= first) {
+		len = (last - first + 1) * pitch;
+		result = usbd480_set_address(d, d->scroll_start + first * d->width);
+		if (!result)
+			result = usbd480_send_bulk(d, d->shadow + first * pitch, len);
+		if (result)
+			goto drop;
+	}
+
+	if (d->scroll_moved) {
+		result = usbd480_set_frame_start_address(d, d->scroll_start);
+		if (result)
+			goto drop;
+		d->scroll_moved = 0;
+	}
+
+	trace_usbd480_frame_flip(d->dev, !d->disp_page, len,
+		d->damage_ns ? ktime_get_ns() - d->damage_ns : 0);
+	if (d->damage_ns) {
+		usbd480_hist_since(d, USBD480_LAT_DAMAGE_TO_VISIBLE, d->damage_ns);
+		d->damage_ns = 0;
+	}
+	usbd480_stats_frame(d, len, ktime_get_ns() - start);
+	if (last >= first)
+		usbd480_count_upload(d, first, last);
+	return 0;
+
+drop:
+	trace_usbd480_frame_drop(d->dev, !d->disp_page, len, result);
+	usbd480_stats_error(d, 1);
+	return result;
+}
+
+/* shadow rows first to last, upside down and right to left, into rotbuf */
+static void usbd480_rotate_rows(struct usbd480 *d, int first, int last)
+{
+	u16 *dst = (u16 *)d->rotbuf;
+	int x, y;
+
+	for (y = last; y >= first; y--) {
+		const u16 *row = (const u16 *)(d->shadow + y * d->width * 2);
+
+		for (x = d->width - 1; x >= 0; x--)
+			*dst++ = row[x];
+	}
+}
+
+/*
+ * Send the rows between first and last from the shadow to the back page
+ * and show it. Rows damaged in the previous frame are added since the
+ * back page still holds the frame before that. Firmware that can't flip
+ * gets the rows written to the shown page, firmware that can't address
+ * rows gets whole frames.
+ */
+static int usbd480_send_frame(struct usbd480 *d, int first, int last)
+{
+	int result;	
+	int writeaddr;
+	int showaddr;
+	int sendfirst, sendlast;
+	int addrrow;
+	unsigned char *src;
+	unsigned int pitch = d->width * 2;
+	unsigned int len;
+	u64 start = ktime_get_ns();
+	u64 t;
+
+	if (d->pages_stale || d->full_frames || !(d->caps & USBD480_CAP_PARTIAL)) {
+		sendfirst = 0;
+		sendlast = d->height - 1;
+	} else if (!(d->caps & USBD480_CAP_PAGES)) {
+		sendfirst = first;
+		sendlast = last;
+	} else {
+		sendfirst = min(first, d->prev_first);
+		sendlast = max(last, d->prev_last);
+	}
+	len = (sendlast - sendfirst + 1) * pitch;
+
+	if (!(d->caps & USBD480_CAP_PAGES))
+		d->disp_page = 0;
+
+	if(d->disp_page == 0)
+	{
+		writeaddr = 0;
+		showaddr = 0;
+	}
+	else
+	{	
+		writeaddr = d->vmemsize;
+		showaddr = d->vmemsize;
+	}
+
+	trace_usbd480_frame_plan(d->dev, d->disp_page, sendfirst, sendlast, len, 1,
+		d->damage_ns);
+
+	t = ktime_get_ns();
+	src = d->shadow + sendfirst * pitch;
+	addrrow = sendfirst;
+	if (d->rotate) {
+		usbd480_rotate_rows(d, sendfirst, sendlast);
+		src = d->rotbuf;
+		addrrow = d->height - 1 - sendlast;
+	}
+
+	result = usbd480_set_address(d, writeaddr + addrrow * d->width);
+	if (result)
+		goto drop;
+	usbd480_hist_since(d, USBD480_LAT_SET_ADDRESS, t);
+
+	t = ktime_get_ns();
+	if (d->damage_ns)
+		usbd480_hist_add(d, USBD480_LAT_DAMAGE_TO_SUBMIT,
+			div_u64(t - d->damage_ns, NSEC_PER_USEC));
+	result = usbd480_send_bulk(d, src, len);
+	if (result)
+		goto drop;
+	usbd480_hist_add(d, USBD480_LAT_BULK_PER_KB,
+		div_u64((ktime_get_ns() - t) * 1024, (u64)len * NSEC_PER_USEC));
+
+	if (d->caps & USBD480_CAP_PAGES) {
+		t = ktime_get_ns();
+		result = usbd480_set_frame_start_address(d, showaddr);
+		if (result)
+			goto drop;
+		usbd480_hist_since(d, USBD480_LAT_FRAME_START, t);
+	}
+
+	trace_usbd480_frame_flip(d->dev, d->disp_page, len,
+		d->damage_ns ? ktime_get_ns() - d->damage_ns : 0);
+	if (d->damage_ns) {
+		usbd480_hist_since(d, USBD480_LAT_DAMAGE_TO_VISIBLE, d->damage_ns);
+		d->damage_ns = 0;
+	}
+	usbd480_stats_frame(d, len, ktime_get_ns() - start);
+	usbd480_count_upload(d, sendfirst, sendlast);
+
+	d->disp_page = !d->disp_page;
+	if (d->pages_stale)
+		d->pages_stale--;
+	d->prev_first = first;
+	d->prev_last = last;
+	return 0;
+
+drop:
+	trace_usbd480_frame_drop(d->dev, d->disp_page, len, result);
+	usbd480_stats_error(d, 1);
+	return result;
+}
+
+/*
+ * Decide how to carry on after a failed frame, called with mem_lock
+ * held. Returns the delay before the next attempt, or a negative value
+ * when the device is gone.
+ */
+static long usbd480_handle_error(struct usbd480 *d, int result)
+{
+	if (d->gone)
+		return -1;
+
+	/* the page being written is in an unknown state, send everything */
+	d->pages_stale = 2;
+	d->scrolling = 0;
+
+	switch (result) {
+	case -ENODEV:
+	case -ESHUTDOWN:
+		/* unplugged, disconnect() follows */
+		WRITE_ONCE(d->gone, 1);
+		return -1;
+	case -EPIPE:
+		dev_dbg(d->dev, "stall, clearing halt\n");
+		d->tp->clear_halt(d);
+		break;
+	case -EOVERFLOW:
+		/* babble leaves the device in an unknown state */
+		dev_warn(d->dev, "babble, resetting device\n");
+		d->tp->reset(d);
+		return -1;
+	case -ETIMEDOUT:
+	default:
+		break;
+	}
+
+	if (d->retries == 0)
+		dev_warn(d->dev, "frame update failed, result = %d\n", result);
+
+	if (++d->retries >= USBD480_MAX_RETRIES) {
+		dev_warn(d->dev, "%d failed updates, resetting device\n", d->retries);
+		d->tp->reset(d);
+		return -1;
+	}
+
+	return d->refresh << min(d->retries, USBD480_MAX_BACKOFF);
+}
+
+static void usbd480fb_work(struct work_struct *work)
+{
+	struct usbd480 *d =
+		container_of(work, struct usbd480, work.work);
+	int first, last;
+	int scroll;
+	int result;
+	long delay = d->refresh;
+
+	if (d->gone)
+		return;
+
+	mutex_lock(&d->mem_lock);
+
+	/* system suspend, usbd480_restore() queues the work again */
+	if (d->suspended) {
+		mutex_unlock(&d->mem_lock);
+		return;
+	}
+
+	/* nobody opened the framebuffer yet */
+	if (!d->vmem)
+		goto out_unlock;
+
+	/* the character device owns the panel */
+	if (d->direct)
+		goto out_unlock;
+
+	/* the self test owns it until the last pattern is done */
+	if (d->selftest_running)
+		goto out_unlock;
+
+	scroll = usbd480_take_scroll(d);
+	if (d->shadow)
+		usbd480_scroll(d, scroll);
+
+	if (!d->shadow) {
+		if (!usbd480_find_idle_damage(d, &first, &last))
+			goto out_unlock;
+	} else if (!usbd480_find_damage(d, &first, &last) && !d->pages_stale) {
+		usbd480_stats_tick(d, 1);
+		if (idle_release &&
+		    time_after(jiffies, d->last_damage + idle_release * HZ))
+			usbd480_release_buffers(d);
+		goto out_unlock;
+	}
+	d->shadow_valid = 1;
+	d->last_damage = jiffies;
+	if (!d->damage_ns && last >= 0)
+		d->damage_ns = ktime_get_ns();
+
+	/* resumes the device if it was autosuspended while idle */
+	result = usbd480_autopm_get(d);
+	if (result) {
+		dev_dbg(d->dev, "autoresume failed\n");
+		usbd480_stats_error(d, 0);
+		d->pages_stale = 2;
+		goto out_unlock;
+	}
+
+	if (d->scrolling)
+		result = usbd480_send_scrolled(d, first, last);
+	else
+		result = usbd480_send_frame(d, first, last);
+	usbd480_stats_tick(d, 0);
+
+	/* still locked, open, panning and the self test set the same state */
+	if (result) {
+		delay = usbd480_handle_error(d, result);
+	} else if (d->retries) {
+		dev_info(d->dev, "recovered after %d failed updates\n", d->retries);
+		d->retries = 0;
+	}
+
+	if (!result)
+		usbd480_first_frame(d);
+
+	usbd480_autopm_put(d);
+	d->passes++;
+	mutex_unlock(&d->mem_lock);
+	wake_up_all(&d->pass_wait);
+
+	if (delay >= 0)
+		queue_delayed_work(d->wq, &d->work, delay);
+	return;
+
+out_unlock:
+	d->passes++;
+	mutex_unlock(&d->mem_lock);
+	wake_up_all(&d->pass_wait);
+	queue_delayed_work(d->wq, &d->work, delay);
+}
+
+/*
+ * Self test, writing to the selftest attribute pauses the refresh, times
+ * a fixed set of uploads and puts the picture back. Reading it returns
+ * the results of the last run. The uploads send zeroes to pages 0 and 1,
+ * so the panel is blank while the test runs. mem_lock is only held for
+ * one pattern at a time, framebuffer writes go on in between.
+ */
+static int usbd480_test_upload(struct usbd480 *d, unsigned int page, int y, int rows)
+{
+	int result;
+
+	result = usbd480_set_address(d, page * d->vmemsize + y * d->width);
+	if (!result)
+		result = usbd480_send_bulk(d, NULL, rows * d->width * 2);
+	return result;
+}
+
+static int usbd480_selftest_one(struct usbd480 *d, int test)
+{
+	struct usbd480_test *t = &d->selftest[test];
+	u64 start;
+	int result = 0;
+	int i, j;
+
+	start = ktime_get_ns();
+	switch (test) {
+	case USBD480_TEST_FULL:
+		/* full frames to alternating pages, like a continuous full update */
+		for (i = 0; i < USBD480_TEST_FULL_RUNS && !result; i++) {
+			result = usbd480_test_upload(d, i & 1, 0, d->height);
+			if (!result)
+				result = usbd480_set_frame_start_address(d, (i & 1) * d->vmemsize);
+			t->bytes += d->vmemsize;
+		}
+		break;
+	case USBD480_TEST_ROW:
+		/* one row and a flip, the smallest update there is */
+		for (i = 0; i < USBD480_TEST_ROW_RUNS && !result; i++) {
+			result = usbd480_test_upload(d, i & 1, i % d->height, 1);
+			if (!result)
+				result = usbd480_set_frame_start_address(d, (i & 1) * d->vmemsize);
+			t->bytes += d->width * 2;
+		}
+		break;
+	case USBD480_TEST_SCATTER:
+		/* rows spread over the screen, each addressed on its own */
+		for (i = 0; i < USBD480_TEST_SCATTER_RUNS && !result; i++) {
+			for (j = 0; j < USBD480_TEST_SCATTER_ROWS && !result; j++)
+				result = usbd480_test_upload(d, i & 1,
+					j * d->height / USBD480_TEST_SCATTER_ROWS, 1);
+			if (!result)
+				result = usbd480_set_frame_start_address(d, (i & 1) * d->vmemsize);
+			t->bytes += USBD480_TEST_SCATTER_ROWS * d->width * 2;
+		}
+		break;
+	default:
+		/* flips only, the command round trip */
+		for (i = 0; i < USBD480_TEST_FLIP_RUNS && !result; i++)
+			result = usbd480_set_frame_start_address(d, (i & 1) * d->vmemsize);
+		break;
+	}
+	t->ns = ktime_get_ns() - start;
+	t->runs = i;
+
+	return result;
+}
+
+static ssize_t show_selftest(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usbd480 *d = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	mutex_lock(&d->mem_lock);
+	if (d->selftest_running) {
+		mutex_unlock(&d->mem_lock);
+		return sprintf(buf, "running\n");
+	}
+	if (!d->selftest_done) {
+		mutex_unlock(&d->mem_lock);
+		return sprintf(buf, "not run\n");
+	}
+
+	if (d->selftest_result)
+		len += sprintf(buf + len, "failed: %d\n", d->selftest_result);
+	for (i = 0; i < USBD480_TEST_COUNT; i++) {
+		struct usbd480_test *t = &d->selftest[i];
+		u64 us = div_u64(t->ns, NSEC_PER_USEC);
+
+		len += sprintf(buf + len, "%-15s %4u runs %6llu us/run %6llu per s %8llu KB/s\n",
+			usbd480_test_names[i], t->runs,
+			t->runs ? div_u64(us, t->runs) : 0,
+			us ? div64_u64((u64)t->runs * USEC_PER_SEC, us) : 0,
+			us ? div64_u64(t->bytes * USEC_PER_SEC, us * 1024) : 0);
+	}
+	mutex_unlock(&d->mem_lock);
+	return len;
+}
+
+static ssize_t set_selftest(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usbd480 *d = dev_get_drvdata(dev);
+	int result;
+	int i;
+
+	if (d->gone)
+		return -ENODEV;
+	/* the uploads go to both pages and single rows */
+	if ((d->caps & USBD480_CAP_ALL) != USBD480_CAP_ALL)
+		return -EOPNOTSUPP;
+
+	result = usbd480_autopm_get(d);
+	if (result)
+		return result;
+
+	mutex_lock(&d->mem_lock);
+	if (d->selftest_running) {
+		mutex_unlock(&d->mem_lock);
+		usbd480_autopm_put(d);
+		return -EBUSY;
+	}
+	/* the worker stays out until the run is over */
+	d->selftest_running = 1;
+	memset(d->selftest, 0, sizeof(d->selftest));
+	result = usbd480_alloc_xfers(d);
+	mutex_unlock(&d->mem_lock);
+
+	for (i = 0; i < USBD480_TEST_COUNT && !result; i++) {
+		mutex_lock(&d->mem_lock);
+		/* the device pages won't hold what the shadow says */
+		d->shadow_valid = 0;
+		d->pages_stale = 2;
+		if (d->gone)
+			result = -ENODEV;
+		else if (d->suspended)
+			result = -EAGAIN;
+		else
+			result = usbd480_selftest_one(d, i);
+		mutex_unlock(&d->mem_lock);
+	}
+
+	mutex_lock(&d->mem_lock);
+	d->selftest_result = result;
+	d->selftest_done = 1;
+	d->selftest_running = 0;
+	dev_info(d->dev, "self test %s\n", result ? "failed" : "done");
+
+	if (!d->vmem && !d->gone)
+		usbd480_clear(d);
+
+	mutex_unlock(&d->mem_lock);
+	usbd480_autopm_put(d);
+
+	if (!d->gone)
+		mod_delayed_work(d->wq, &d->work, 0);
+	return result ? result : count;
+}
+
+static DEVICE_ATTR(selftest, S_IWUSR | S_IRUGO, show_selftest, set_selftest);
+
+/*
+ * Direct mode, the character device. See usbd480fb.h for the command
+ * stream. The framebuffer poller stays out of the way while the device
+ * is open and resends the whole framebuffer once it is closed.
+ */
+static void usbd480_direct_free(struct usbd480 *d)
+{
+	int p;
+
+	for (p = 0; p < USBD480_DIRECT_PAGES; p++) {
+		vfree(d->direct_page[p]);
+		bitmap_free(d->direct_dirty[p]);
+		d->direct_page[p] = NULL;
+		d->direct_dirty[p] = NULL;
+	}
+}
+
+/* the device pages are unknown, everything is sent on the first flush */
+static void usbd480_direct_invalidate(struct usbd480 *d)
+{
+	int p;
+
+	for (p = 0; p < USBD480_DIRECT_PAGES; p++)
+		bitmap_fill(d->direct_dirty[p], d->height);
+}
+
+static int usbd480_direct_alloc(struct usbd480 *d)
+{
+	int p;
+
+	for (p = 0; p < USBD480_DIRECT_PAGES; p++) {
+		d->direct_page[p] = vzalloc(d->vmemsize);
+		d->direct_dirty[p] = bitmap_zalloc(d->height, GFP_KERNEL);
+		if (!d->direct_page[p] || !d->direct_dirty[p]) {
+			usbd480_direct_free(d);
+			return -ENOMEM;
+		}
+	}
+	usbd480_direct_invalidate(d);
+	return 0;
+}
+
+/*
+ * Send the changed rows of a page. Spans separated by only a few clean
+ * rows go out as one, resending those is cheaper than another command.
+ */
+static int usbd480_direct_flush(struct usbd480 *d, unsigned int page)
+{
+	unsigned long *dirty = d->direct_dirty[page];
+	unsigned int pitch = d->width * 2;
+	unsigned int first, end, next;
+	int result;
+
+	first = find_first_bit(dirty, d->height);
+	while (first < d->height) {
+		end = find_next_zero_bit(dirty, d->height, first);
+		while (end < d->height) {
+			next = find_next_bit(dirty, d->height, end);
+			if (next >= d->height || next - end > USBD480_SPAN_GAP)
+				break;
+			end = find_next_zero_bit(dirty, d->height, next);
+		}
+
+		result = usbd480_set_address(d, page * d->vmemsize + first * d->width);
+		if (!result)
+			result = usbd480_send_bulk(d, d->direct_page[page] + first * pitch,
+				(end - first) * pitch);
+		if (result)
+			return result;
+
+		bitmap_clear(dirty, first, end - first);
+		d->direct_bytes += (end - first) * pitch;
+		first = find_next_bit(dirty, d->height, end);
+	}
+	return 0;
+}
+
+static int usbd480_direct_flush_all(struct usbd480 *d)
+{
+	int result = 0;
+	int p;
+
+	for (p = 0; p < USBD480_DIRECT_PAGES && !result; p++)
+		result = usbd480_direct_flush(d, p);
+	return result;
+}
+
+/*
+ * After a reset, put the pages back and show the one that was shown.
+ * Resets only mark the pages stale since they can happen in the middle of
+ * an autoresume with the lock held, whoever takes the lock next resyncs.
+ */
+static void usbd480_direct_resync(struct usbd480 *d)
+{
+	int result;
+
+	if (!d->pages_stale)
+		return;
+	d->pages_stale = 0;
+	usbd480_direct_invalidate(d);
+
+	result = usbd480_direct_flush_all(d);
+	if (!result)
+		result = usbd480_set_frame_start_address(d, d->direct_shown * d->vmemsize);
+	if (result) {
+		dev_warn(d->dev, "restoring direct pages failed: %d\n", result);
+		d->pages_stale = 2;
+	}
+}
+
+static int usbd480_direct_blit(struct usbd480 *d, const struct usbd480_cmd *cmd,
+		const unsigned char *payload)
+{
+	unsigned int pitch = d->width * 2;
+	unsigned char *dst;
+	int y;
+
+	if (cmd->page >= USBD480_DIRECT_PAGES || !cmd->w || !cmd->h ||
+	    cmd->x + cmd->w > d->width || cmd->y + cmd->h > d->height)
+		return -EINVAL;
+
+	dst = d->direct_page[cmd->page] + cmd->y * pitch + cmd->x * 2;
+	for (y = 0; y < cmd->h; y++)
+		memcpy(dst + y * pitch, payload + y * cmd->w * 2, cmd->w * 2);
+	bitmap_set(d->direct_dirty[cmd->page], cmd->y, cmd->h);
+	return 0;
+}
+
+static int usbd480_direct_cmd(struct usbd480 *d, const struct usbd480_cmd *cmd,
+		const unsigned char *payload, u64 start)
+{
+	int result;
+
+	switch (cmd->op) {
+	case USBD480_CMD_BLIT:
+		return usbd480_direct_blit(d, cmd, payload);
+	case USBD480_CMD_FLIP:
+		if (cmd->page >= USBD480_DIRECT_PAGES)
+			return -EINVAL;
+		result = usbd480_direct_flush_all(d);
+		if (!result)
+			result = usbd480_set_frame_start_address(d, cmd->page * d->vmemsize);
+		if (result)
+			return result;
+		d->direct_shown = cmd->page;
+		trace_usbd480_frame_flip(d->dev, cmd->page, d->direct_bytes, 0);
+		usbd480_stats_frame(d, d->direct_bytes, ktime_get_ns() - start);
+		d->direct_bytes = 0;
+		return 0;
+	case USBD480_CMD_BRIGHTNESS:
+		d->brightness = cmd->value;
+		d->brightness_set = 1;
+		return usbd480_set_brightness(d, cmd->value);
+	case USBD480_CMD_FENCE:
+		result = usbd480_direct_flush_all(d);
+		if (!result)
+			d->fence = cmd->value;
+		return result;
+	default:
+		return -EINVAL;
+	}
+}
+
+static size_t usbd480_cmd_len(const struct usbd480_cmd *cmd)
+{
+	size_t len = sizeof(*cmd);
+
+	if (cmd->op == USBD480_CMD_BLIT)
+		len += ALIGN((size_t)cmd->w * cmd->h * 2, 4);
+	return len;
+}
+
+/*
+ * Run the commands in buf. Returns the bytes used, which is short when
+ * the last command does not fit, or a negative error.
+ */
+static ssize_t usbd480_direct_batch(struct usbd480 *d, const unsigned char *buf, size_t count)
+{
+	u64 start = ktime_get_ns();
+	size_t pos = 0;
+	int result = 0;
+
+	usbd480_direct_resync(d);
+
+	while (pos + sizeof(struct usbd480_cmd) <= count) {
+		const struct usbd480_cmd *cmd = (const void *)(buf + pos);
+		size_t len = usbd480_cmd_len(cmd);
+
+		if (pos + len > count)
+			break;
+
+		result = usbd480_direct_cmd(d, cmd, buf + pos + sizeof(*cmd), start);
+		if (result)
+			break;
+		pos += len;
+	}
+
+	if (!result)
+		result = usbd480_direct_flush_all(d);
+	if (result) {
+		usbd480_stats_error(d, 0);
+		return result;
+	}
+	return pos ? pos : -EINVAL;
+}
+
+/*
+ * Jobs run by the job work in submission order: user pointer rectangles
+ * and the batches of non-blocking writes. User pointer pages are pinned
+ * at submit time and sent from where they are. The driver keeps no copy
+ * of them, so those rows are not restored after a reset. Each job queues
+ * a completion for read() and poll() and signals its eventfd, if any.
+ */
+struct usbd480_job {
+	struct list_head list;
+	struct usbd480_userptr req;
+	struct page **pages;
+	unsigned int npages;
+	unsigned long start;		/* user address of pages[0] */
+	struct eventfd_ctx *eventfd;
+	unsigned char *batch;		/* commands of a write, instead of req */
+	size_t len;
+};
+
+static void usbd480_job_free(struct usbd480_job *job)
+{
+	if (job->pages) {
+		unpin_user_pages(job->pages, job->npages);
+		kvfree(job->pages);
+	}
+	kvfree(job->batch);
+	if (job->eventfd)
+		eventfd_ctx_put(job->eventfd);
+	kfree(job);
+}
+
+/* queue a job or fail with -EAGAIN when all slots are taken */
+static int usbd480_job_queue(struct usbd480 *d, struct usbd480_job *job)
+{
+	if (atomic_inc_return(&d->jobs_queued) > USBD480_JOBS_MAX) {
+		atomic_dec(&d->jobs_queued);
+		return -EAGAIN;
+	}
+
+	/*
+	 * teardown sets gone and takes job_lock before it destroys the
+	 * queue. Not mem_lock, the worker holds that across a transfer.
+	 */
+	spin_lock_irq(&d->job_lock);
+	if (READ_ONCE(d->gone)) {
+		spin_unlock_irq(&d->job_lock);
+		atomic_dec(&d->jobs_queued);
+		return -ENODEV;
+	}
+	list_add_tail(&job->list, &d->jobs);
+	queue_work(d->wq, &d->job_work);
+	spin_unlock_irq(&d->job_lock);
+	return 0;
+}
+
+static void usbd480_complete(struct usbd480 *d, u32 id, int status)
+{
+	struct usbd480_completion c = { .id = id, .status = status };
+	unsigned long flags;
+
+	spin_lock_irqsave(&d->job_lock, flags);
+	if (!kfifo_put(&d->completions, c))
+		d->completions_lost++;
+	spin_unlock_irqrestore(&d->job_lock, flags);
+	wake_up_interruptible(&d->direct_wait);
+}
+
+/* len bytes starting offset bytes into pages, bounced if need be */
+static int usbd480_send_pages(struct usbd480 *d, struct page **pages,
+		unsigned int npages, unsigned int offset, unsigned int len)
+{
+	void *vaddr;
+	int result = -EOPNOTSUPP;
+
+	if (d->tp->write_pages)
+		result = d->tp->write_pages(d, pages, npages, offset, len);
+	if (result != -EOPNOTSUPP)
+		return result;
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL_RO);
+	if (!vaddr)
+		return -ENOMEM;
+	result = usbd480_send_bulk(d, vaddr + offset, len);
+	vunmap(vaddr);
+	return result;
+}
+
+static int usbd480_job_run(struct usbd480 *d, struct usbd480_job *job)
+{
+	const struct usbd480_userptr *req = &job->req;
+	unsigned int rowlen = req->w * 2;
+	unsigned int rows, y;
+	u64 start = ktime_get_ns();
+	int result = 0;
+
+	/* full width rows lying back to back go out as one transfer */
+	if (req->x == 0 && req->w == d->width && req->pitch == rowlen) {
+		rowlen *= req->h;
+		rows = 1;
+	} else {
+		rows = req->h;
+	}
+
+	for (y = 0; y < rows && !result; y++) {
+		unsigned long off = req->addr - job->start + (unsigned long)y * req->pitch;
+		unsigned int first = off >> PAGE_SHIFT;
+		unsigned int offset = offset_in_page(off);
+
+		result = usbd480_set_address(d, req->page * d->vmemsize +
+			(req->y + y) * d->width + req->x);
+		if (!result)
+			result = usbd480_send_pages(d, job->pages + first,
+				DIV_ROUND_UP(offset + rowlen, PAGE_SIZE), offset, rowlen);
+		d->direct_bytes += rowlen;
+	}
+
+	if (!result && (req->flags & USBD480_USERPTR_FLIP)) {
+		result = usbd480_set_frame_start_address(d, req->page * d->vmemsize);
+		if (!result) {
+			d->direct_shown = req->page;
+			trace_usbd480_frame_flip(d->dev, req->page, d->direct_bytes, 0);
+			usbd480_stats_frame(d, d->direct_bytes, ktime_get_ns() - start);
+			d->direct_bytes = 0;
+		}
+	}
+	if (result)
+		usbd480_stats_error(d, 0);
+	return result;
+}
+
+static void usbd480_job_work(struct work_struct *work)
+{
+	struct usbd480 *d = container_of(work, struct usbd480, job_work);
+	struct usbd480_job *job;
+	unsigned long flags;
+	int result;
+
+	for (;;) {
+		/* jobs wait out a system suspend on the list */
+		if (READ_ONCE(d->suspended))
+			break;
+
+		spin_lock_irqsave(&d->job_lock, flags);
+		job = list_first_entry_or_null(&d->jobs, struct usbd480_job, list);
+		if (job)
+			list_del(&job->list);
+		spin_unlock_irqrestore(&d->job_lock, flags);
+		if (!job)
+			break;
+
+		result = d->gone ? -ENODEV : usbd480_autopm_get(d);
+		if (!result) {
+			mutex_lock(&d->mem_lock);
+			usbd480_direct_resync(d);
+			if (job->batch)
+				result = usbd480_direct_batch(d, job->batch, job->len);
+			else
+				result = usbd480_job_run(d, job);
+			mutex_unlock(&d->mem_lock);
+			usbd480_autopm_put(d);
+		}
+
+		/* the slot is free before poll() is woken */
+		atomic_dec(&d->jobs_queued);
+		usbd480_complete(d, job->req.id, min(result, 0));
+		if (job->eventfd)
+			eventfd_signal(job->eventfd);
+		usbd480_job_free(job);
+	}
+}
+
+static int usbd480_submit_userptr(struct usbd480 *d, void __user *arg)
+{
+	struct usbd480_job *job;
+	struct usbd480_userptr *req;
+	unsigned long end;
+	int pinned;
+	int retval;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	req = &job->req;
+
+	retval = -EFAULT;
+	if (copy_from_user(req, arg, sizeof(*req)))
+		goto error_job;
+
+	retval = -EINVAL;
+	if (req->page >= USBD480_DIRECT_PAGES || !req->w || !req->h ||
+	    req->x + req->w > d->width || req->y + req->h > d->height ||
+	    req->pitch < req->w * 2 || req->pitch > USBD480_BATCH_MAX / req->h)
+		goto error_job;
+
+	job->start = req->addr & PAGE_MASK;
+	end = req->addr + (unsigned long)(req->h - 1) * req->pitch + req->w * 2;
+	job->npages = DIV_ROUND_UP(end - job->start, PAGE_SIZE);
+
+	if (req->eventfd >= 0) {
+		job->eventfd = eventfd_ctx_fdget(req->eventfd);
+		if (IS_ERR(job->eventfd)) {
+			retval = PTR_ERR(job->eventfd);
+			job->eventfd = NULL;
+			goto error_job;
+		}
+	}
+
+	job->pages = kvmalloc_array(job->npages, sizeof(struct page *), GFP_KERNEL);
+	if (!job->pages) {
+		retval = -ENOMEM;
+		goto error_eventfd;
+	}
+
+	pinned = pin_user_pages_fast(job->start, job->npages, 0, job->pages);
+	if (pinned != job->npages) {
+		if (pinned > 0)
+			unpin_user_pages(job->pages, pinned);
+		retval = pinned < 0 ? pinned : -EFAULT;
+		goto error_pages;
+	}
+
+	retval = usbd480_job_queue(d, job);
+	if (retval)
+		usbd480_job_free(job);
+	return retval;
+
+error_pages:
+	kvfree(job->pages);
+error_eventfd:
+	if (job->eventfd)
+		eventfd_ctx_put(job->eventfd);
+error_job:
+	kfree(job);
+	return retval;
+}
+
+/*
+ * A non-blocking write is parsed for whole commands and queued as a job,
+ * the completion carrying the id of its last fence, or 0. With all job
+ * slots taken it fails with -EAGAIN and poll() reports POLLOUT again once
+ * one frees up. Blocking writes run the batch right away. io_uring's
+ * inline attempt doesn't sleep for memory, when that isn't at hand it
+ * gets -EAGAIN and comes back from a worker.
+ */
+static ssize_t usbd480_direct_write_async(struct usbd480 *d, struct iov_iter *from,
+		size_t count, int nowait)
+{
+	gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+	const struct usbd480_cmd *cmd;
+	struct usbd480_job *job;
+	size_t pos = 0;
+	ssize_t ret;
+
+	if (atomic_read(&d->jobs_queued) >= USBD480_JOBS_MAX)
+		return -EAGAIN;
+
+	job = kzalloc(sizeof(*job), gfp);
+	if (!job)
+		return nowait ? -EAGAIN : -ENOMEM;
+	job->batch = kvmalloc(count, gfp);
+	if (!job->batch) {
+		ret = nowait ? -EAGAIN : -ENOMEM;
+		goto error;
+	}
+	if (copy_from_iter(job->batch, count, from) != count) {
+		ret = -EFAULT;
+		goto error;
+	}
+
+	while (pos + sizeof(*cmd) <= count) {
+		size_t len;
+
+		cmd = (const void *)(job->batch + pos);
+		len = usbd480_cmd_len(cmd);
+		if (pos + len > count)
+			break;
+		if (cmd->op == USBD480_CMD_FENCE)
+			job->req.id = cmd->value;
+		pos += len;
+	}
+	if (!pos) {
+		ret = -EINVAL;
+		goto error;
+	}
+	job->len = pos;
+
+	ret = usbd480_job_queue(d, job);
+	if (ret)
+		goto error;
+	/* the tail that was copied but not taken is written again */
+	iov_iter_revert(from, count - pos);
+	return pos;
+
+error:
+	usbd480_job_free(job);
+	return ret;
+}
+
+static ssize_t usbd480_direct_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct usbd480 *d = iocb->ki_filp->private_data;
+	size_t count = min_t(size_t, iov_iter_count(from), USBD480_BATCH_MAX);
+	unsigned char *buf;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	if (iocb->ki_filp->f_flags & O_NONBLOCK)
+		return usbd480_direct_write_async(d, from, count,
+			iocb->ki_flags & IOCB_NOWAIT);
+	/* the batch goes out on the wire, io_uring retries it from a worker */
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	buf = kvmalloc(count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_iter(buf, count, from) != count) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* jobs submitted before this go first */
+	flush_work(&d->job_work);
+
+	ret = usbd480_autopm_get(d);
+	if (ret)
+		goto out;
+	mutex_lock(&d->mem_lock);
+	if (d->gone)
+		ret = -ENODEV;
+	else
+		ret = usbd480_direct_batch(d, buf, count);
+	mutex_unlock(&d->mem_lock);
+	usbd480_autopm_put(d);
+out:
+	kvfree(buf);
+	return ret;
+}
+
+/* completions of queued jobs, as many whole records as fit */
+static ssize_t usbd480_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct usbd480 *d = file->private_data;
+	unsigned int copied;
+	int retval;
+
+	if (count < sizeof(struct usbd480_completion))
+		return -EINVAL;
+
+	for (;;) {
+		mutex_lock(&d->read_lock);
+		retval = kfifo_to_user(&d->completions, buf,
+			rounddown(count, sizeof(struct usbd480_completion)), &copied);
+		mutex_unlock(&d->read_lock);
+		if (retval)
+			return retval;
+		if (copied)
+			return copied;
+
+		if (d->gone)
+			return -ENODEV;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		retval = wait_event_interruptible(d->direct_wait,
+			!kfifo_is_empty(&d->completions) || d->gone);
+		if (retval)
+			return retval;
+	}
+}
+
+static __poll_t usbd480_poll(struct file *file, poll_table *wait)
+{
+	struct usbd480 *d = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &d->direct_wait, wait);
+	if (!kfifo_is_empty(&d->completions))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (atomic_read(&d->jobs_queued) < USBD480_JOBS_MAX)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	if (d->gone)
+		mask |= EPOLLHUP | EPOLLERR;
+	return mask;
+}
+
+static long usbd480_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct usbd480 *d = file->private_data;
+	struct usbd480_details details;
+	int result;
+
+	if (d->gone)
+		return -ENODEV;
+
+	switch (cmd) {
+	case IOCTL_SET_BRIGHTNESS:
+		result = usbd480_autopm_get(d);
+		if (result)
+			return result;
+		d->brightness = arg;
+		d->brightness_set = 1;
+		result = usbd480_set_brightness(d, arg);
+		usbd480_autopm_put(d);
+		return result;
+	case IOCTL_SUBMIT_USERPTR:
+		return usbd480_submit_userptr(d, (void __user *)arg);
+	case IOCTL_GET_DEVICE_DETAILS:
+		memset(&details, 0, sizeof(details));
+		memcpy(details.name, d->device_name, sizeof(details.name));
+		details.width = d->width;
+		details.height = d->height;
+		if (copy_to_user((void __user *)arg, &details, sizeof(details)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* one user at a time, it owns the device pages until it closes */
+static int usbd480_direct_open(struct usbd480 *d, struct file *file)
+{
+	int retval;
+
+	mutex_lock(&d->mem_lock);
+	if (d->gone) {
+		retval = -ENODEV;
+		goto out;
+	}
+	if (d->direct) {
+		retval = -EBUSY;
+		goto out;
+	}
+	/* the page images need rows sent on their own and two pages */
+	if ((d->caps & USBD480_CAP_ALL) != USBD480_CAP_ALL) {
+		retval = -EOPNOTSUPP;
+		goto out;
+	}
+	/* they are in the panel's order, user pointer jobs can't be turned */
+	if (d->rotate) {
+		retval = -EOPNOTSUPP;
+		goto out;
+	}
+
+	retval = usbd480_alloc_xfers(d);
+	if (!retval)
+		retval = usbd480_direct_alloc(d);
+	if (retval)
+		goto out;
+
+	d->direct = 1;
+	d->scrolling = 0;
+	d->direct_bytes = 0;
+	kfifo_reset(&d->completions);
+	d->direct_shown = 0;
+	d->pages_stale = 0;	/* the first flush sends everything anyway */
+	d->shadow_valid = 0;
+	kref_get(&d->kref);
+	file->private_data = d;
+	/* io_uring may queue non-blocking writes inline */
+	file->f_mode |= FMODE_NOWAIT;
+out:
+	mutex_unlock(&d->mem_lock);
+	return retval;
+}
+
+static int usbd480_open(struct inode *inode, struct file *file)
+{
+	struct usb_interface *interface;
+	struct usbd480 *d;
+
+	interface = usb_find_interface(&usbd480_driver, iminor(inode));
+	if (!interface)
+		return -ENODEV;
+	d = usb_get_intfdata(interface);
+	if (!d)
+		return -ENODEV;
+
+	return usbd480_direct_open(d, file);
+}
+
+static int usbd480_fake_open(struct inode *inode, struct file *file)
+{
+	struct usbd480 *d = container_of(file->private_data, struct usbd480, misc);
+
+	return usbd480_direct_open(d, file);
+}
+
+static int usbd480_release(struct inode *inode, struct file *file)
+{
+	struct usbd480 *d = file->private_data;
+
+	/* unpins whatever is still queued */
+	flush_work(&d->job_work);
+
+	mutex_lock(&d->mem_lock);
+	usbd480_direct_free(d);
+	d->direct = 0;
+	d->pages_stale = 2;
+	/* teardown sets gone under the lock before it destroys the queue */
+	if (!d->gone)
+		queue_delayed_work(d->wq, &d->work, 0);
+	mutex_unlock(&d->mem_lock);
+
+	kref_put(&d->kref, usbd480_delete);
+	return 0;
+}
+
+static const struct file_operations usbd480_fops = {
+	.owner =	THIS_MODULE,
+	.read =		usbd480_read,
+	.write_iter =	usbd480_direct_write,
+	.poll =		usbd480_poll,
+	.unlocked_ioctl = usbd480_ioctl,
+	.open =		usbd480_open,
+	.release =	usbd480_release,
+	.llseek =	noop_llseek,
+};
+
+static const struct file_operations usbd480_fake_fops = {
+	.owner =	THIS_MODULE,
+	.read =		usbd480_read,
+	.write_iter =	usbd480_direct_write,
+	.poll =		usbd480_poll,
+	.unlocked_ioctl = usbd480_ioctl,
+	.open =		usbd480_fake_open,
+	.release =	usbd480_release,
+	.llseek =	noop_llseek,
+};
+
+static struct usb_class_driver usbd480_class = {
+	.name =		"usbd480-%d",
+	.fops =		&usbd480_fops,
+	.minor_base =	USBD480_MINOR_BASE,
+};
+
+
+/*
+ * Damage from the drawing ops. While nothing has the framebuffer mapped
+ * every change goes through them, so the worker only compares the rows
+ * they report. Rows are counted in the whole framebuffer memory, both
+ * frames.
+ */
+static void usbd480_ops_damage(struct usbd480 *d, int y, int h)
+{
+	unsigned long flags;
+
+	if (h <= 0)
+		return;
+
+	spin_lock_irqsave(&d->ops_lock, flags);
+	d->ops_first = min(d->ops_first, y);
+	d->ops_last = max(d->ops_last, y + h - 1);
+	spin_unlock_irqrestore(&d->ops_lock, flags);
+}
+
+static void usbd480_ops_damage_all(struct usbd480 *d)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&d->ops_lock, flags);
+	d->ops_full = 1;
+	spin_unlock_irqrestore(&d->ops_lock, flags);
+}
+
+static void usbd480fb_vm_open(struct vm_area_struct *vma)
+{
+	struct usbd480 *d = vma->vm_private_data;
+
+	atomic_inc(&d->mapped);
+}
+
+/* what was drawn through the mapping was never reported */
+static void usbd480fb_vm_close(struct vm_area_struct *vma)
+{
+	struct usbd480 *d = vma->vm_private_data;
+
+	if (atomic_dec_and_test(&d->mapped))
+		usbd480_ops_damage_all(d);
+}
+
+static const struct vm_operations_struct usbd480fb_vm_ops = {
+	.open =		usbd480fb_vm_open,
+	.close =	usbd480fb_vm_close,
+};
+
+static ssize_t usbd480fb_write(struct fb_info *info, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	unsigned int pitch = info->fix.line_length;
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = fb_sys_write(info, buf, count, ppos);
+	if (ret > 0)
+		usbd480_ops_damage(info->par, pos / pitch,
+			(pos + ret - 1) / pitch - pos / pitch + 1);
+	return ret;
+}
+
+/* 64 bit stores for the middle of a row, whatever the alignment of the ends */
+static void usbd480_xor16(u16 *dst, u16 val, unsigned int n)
+{
+	u64 pat = val * 0x0001000100010001ULL;
+
+	for (; n && ((unsigned long)dst & 7); n--)
+		*dst++ ^= val;
+	for (; n >= 4; n -= 4, dst += 4)
+		*(u64 *)dst ^= pat;
+	while (n--)
+		*dst++ ^= val;
+}
+
+static void usbd480fb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+	unsigned int pitch = info->fix.line_length;
+	u8 *base = (u8 *)info->screen_base + rect->dy * pitch + rect->dx * 2;
+	u16 color;
+	int j;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return;
+
+	color = ((u32 *)info->pseudo_palette)[rect->color];
+	for (j = 0; j < rect->height; j++, base += pitch) {
+		if (rect->rop == ROP_XOR)
+			usbd480_xor16((u16 *)base, color, rect->width);
+		else
+			memset16((u16 *)base, color, rect->width);
+	}
+
+	usbd480_ops_damage(info->par, rect->dy, rect->height);
+}
+
+/*
+ * fbcon scrolls by moving each text line up on its own, one copyarea per
+ * run of characters that changed, top to bottom. Moves up by the same
+ * rows are added up as one scroll, a move back at the top starts the
+ * next one. The worker moves the device's frame start instead of sending
+ * the moved rows again.
+ */
+static void usbd480_scroll_track(struct usbd480 *d, const struct fb_copyarea *area)
+{
+	int n = area->sy - area->dy;
+
+	if (d->scroll_pending < 0)
+		return;
+	if (n <= 0 || (d->scroll_delta && n != d->scroll_delta)) {
+		d->scroll_pending = -1;
+		return;
+	}
+
+	if (!d->scroll_delta || area->dy < d->scroll_dy ||
+	    (area->dy == d->scroll_dy && area->dx <= d->scroll_dx))
+		d->scroll_pending += n;
+	d->scroll_delta = n;
+	d->scroll_dy = area->dy;
+	d->scroll_dx = area->dx;
+}
+
+static void usbd480fb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+	struct usbd480 *d = info->par;
+	unsigned int pitch = info->fix.line_length;
+	u8 *base = (u8 *)info->screen_base;
+	unsigned long flags;
+	int j;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return;
+
+	if (area->sx == 0 && area->dx == 0 && area->width == info->var.xres) {
+		/* whole rows are one block */
+		memmove(base + area->dy * pitch, base + area->sy * pitch,
+			area->height * pitch);
+	} else if (area->dy > area->sy) {
+		for (j = area->height - 1; j >= 0; j--)
+			memmove(base + (area->dy + j) * pitch + area->dx * 2,
+				base + (area->sy + j) * pitch + area->sx * 2, area->width * 2);
+	} else {
+		for (j = 0; j < area->height; j++)
+			memmove(base + (area->dy + j) * pitch + area->dx * 2,
+				base + (area->sy + j) * pitch + area->sx * 2, area->width * 2);
+	}
+
+	if (area->sx == area->dx && area->sy != area->dy && info->var.yoffset == 0) {
+		spin_lock_irqsave(&d->ops_lock, flags);
+		usbd480_scroll_track(d, area);
+		spin_unlock_irqrestore(&d->ops_lock, flags);
+	}
+	usbd480_ops_damage(d, area->dy, area->height);
+}
+
+/*
+ * Expanded glyph bytes for a colour pair: the 8 pixels each byte of a
+ * 1 bpp glyph row turns into. fbcon draws in a handful of colours, so a
+ * few pairs cover it and a glyph row becomes one 16 byte copy per byte.
+ */
+static struct usbd480_glyphs *usbd480_glyphs_get(struct usbd480 *d, u32 fg, u32 bg)
+{
+	struct usbd480_glyphs *g;
+	int i, b;
+
+	for (i = 0; i < USBD480_GLYPH_PAIRS; i++) {
+		g = &d->glyphs[i];
+		if (g->valid && g->fg == fg && g->bg == bg)
+			return g;
+	}
+
+	g = &d->glyphs[d->glyph_next];
+	d->glyph_next = (d->glyph_next + 1) % USBD480_GLYPH_PAIRS;
+	for (b = 0; b < 256; b++)
+		for (i = 0; i < 8; i++)
+			g->px[b][i] = b & (0x80 >> i) ? fg : bg;
+	g->fg = fg;
+	g->bg = bg;
+	g->valid = 1;
+	return g;
+}
+
+static void usbd480fb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	struct usbd480 *d = info->par;
+	unsigned int spitch = DIV_ROUND_UP(image->width, 8);
+	unsigned int whole = image->width / 8;
+	unsigned int rest = image->width % 8;
+	struct usbd480_glyphs *g;
+	u32 fg, bg;
+	int i, j;
+
+	if (info->state != FBINFO_STATE_RUNNING)
+		return;
+
+	if (image->depth != 1 || !d->glyphs) {
+		sys_imageblit(info, image);
+		goto damage;
+	}
+
+	fg = ((u32 *)info->pseudo_palette)[image->fg_color];
+	bg = ((u32 *)info->pseudo_palette)[image->bg_color];
+	g = usbd480_glyphs_get(d, fg, bg);
+
+	for (j = 0; j < image->height; j++) {
+		const u8 *src = image->data + j * spitch;
+		u16 *dst = (u16 *)(info->screen_base + (image->dy + j) * info->fix.line_length)
+			+ image->dx;
+
+		for (i = 0; i < whole; i++, dst += 8)
+			memcpy(dst, g->px[src[i]], 16);
+		if (rest)
+			memcpy(dst, g->px[src[whole]], rest * 2);
+	}
+
+damage:
+	usbd480_ops_damage(d, image->dy, image->height);
+}
+
+/* the 16 colours fbcon draws with, the panel itself is RGB565 */
+static int usbd480fb_setcolreg(unsigned int regno, unsigned int red, unsigned int green,
+		unsigned int blue, unsigned int transp, struct fb_info *info)
+{
+	if (regno >= 16)
+		return -EINVAL;
+
+	((u32 *)info->pseudo_palette)[regno] =
+		(red & 0xf800) | ((green & 0xfc00) >> 5) | (blue >> 11);
+	return 0;
+}
+
+/*
+ * Panning picks which of the two frames in the framebuffer memory the
+ * worker sends, the device's own pages stay with the worker. The new
+ * frame goes out right away instead of at the next refresh.
+ */
+static int usbd480fb_pan_display(struct fb_var_screeninfo *var,
+			struct fb_info *info)
+{
+	struct usbd480 *d = info->par;
+	int retval = 0;
+
+	if (var->xoffset != 0) /* not supported */
+		return -EINVAL;
+
+	if (var->yoffset + info->var.yres > info->var.yres_virtual)
+		return -EINVAL;
+
+	mutex_lock(&d->mem_lock);
+	if (d->gone) {
+		retval = -ENODEV;
+		goto out;
+	}
+	if (d->yoffset != var->yoffset) {
+		d->yoffset = var->yoffset;
+		d->hint_last = -1;
+		usbd480_ops_damage_all(d);
+		if (!d->damage_ns)
+			d->damage_ns = ktime_get_ns();
+	}
+	mod_delayed_work(d->wq, &d->work, 0);
+out:
+	mutex_unlock(&d->mem_lock);
+	return retval;
+}
+
+/*
+ * Wait for a worker run that starts after the call, so whatever was
+ * drawn before is on the panel when this returns.
+ */
+static int usbd480fb_wait_frame(struct usbd480 *d)
+{
+	u32 target;
+	long ret;
+
+	/* teardown sets gone under the lock before it destroys the queue */
+	mutex_lock(&d->mem_lock);
+	if (d->gone) {
+		mutex_unlock(&d->mem_lock);
+		return -ENODEV;
+	}
+	target = d->passes + 1;
+	mod_delayed_work(d->wq, &d->work, 0);
+	mutex_unlock(&d->mem_lock);
+
+	ret = wait_event_interruptible_timeout(d->pass_wait,
+		(s32)(d->passes - target) >= 0 || d->gone, HZ);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ETIMEDOUT;
+	return d->gone ? -ENODEV : 0;
+}
+
+static int usbd480fb_damage(struct usbd480 *d, void __user *arg)
+{
+	struct usbd480_damage dmg;
+
+	if (copy_from_user(&dmg, arg, sizeof(dmg)))
+		return -EFAULT;
+	if (!dmg.h || dmg.y >= d->height || dmg.h > d->height - dmg.y)
+		return -EINVAL;
+
+	mutex_lock(&d->mem_lock);
+	if (d->gone) {
+		mutex_unlock(&d->mem_lock);
+		return -ENODEV;
+	}
+	if (d->hint_last < 0) {
+		d->hint_first = dmg.y;
+		d->hint_last = dmg.y + dmg.h - 1;
+	} else {
+		d->hint_first = min_t(int, d->hint_first, dmg.y);
+		d->hint_last = max_t(int, d->hint_last, dmg.y + dmg.h - 1);
+	}
+	if (!d->damage_ns)
+		d->damage_ns = ktime_get_ns();
+	mod_delayed_work(d->wq, &d->work, 0);
+	mutex_unlock(&d->mem_lock);
+	return 0;
+}
+
+static int usbd480fb_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg)
+{
+	struct usbd480 *d = info->par;
+	u32 crtc;
+
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		if (get_user(crtc, (u32 __user *)arg))
+			return -EFAULT;
+		if (crtc != 0)
+			return -ENODEV;
+		return usbd480fb_wait_frame(d);
+	case IOCTL_DAMAGE:
+		return usbd480fb_damage(d, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * The framebuffer memory and the shadow are only allocated once the
+ * framebuffer is opened, by a client or by fbcon binding to it.
+ */
+static int usbd480fb_open(struct fb_info *info, int user)
+{
+	struct usbd480 *dev = info->par;
+	int retval = 0;
+
+	mutex_lock(&dev->mem_lock);
+	if (dev->vmem)
+		goto out;
+
+	dev->shadow = vmalloc(dev->vmemsize);
+	dev->vmem = vmalloc_user(dev->vmemsize * 2);
+	if (!dev->vmem || !dev->shadow) {
+		vfree(dev->vmem);
+		vfree(dev->shadow);
+		dev->vmem = NULL;
+		dev->shadow = NULL;
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	if (dev->splash_fw) {
+		memcpy(dev->vmem, dev->splash_fw->data, dev->vmemsize);
+		release_firmware(dev->splash_fw);
+		dev->splash_fw = NULL;
+	}
+
+	dev->shadow_valid = 0;
+	dev->pages_stale = 2;
+	dev->last_damage = jiffies;
+	info->screen_base = (char __iomem *) dev->vmem;
+
+	dev_dbg(dev->dev, "allocated %luK of framebuffer memory\n",
+		dev->vmemsize * 2 >> 10);
+out:
+	mutex_unlock(&dev->mem_lock);
+	return retval;
+}
+
+static int usbd480fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct usbd480 *dev = info->par;
+	int retval;
+
+	retval = remap_vmalloc_range(vma, dev->vmem, vma->vm_pgoff);
+	if (retval)
+		return retval;
+
+	vma->vm_ops = &usbd480fb_vm_ops;
+	vma->vm_private_data = dev;
+	usbd480fb_vm_open(vma);
+	return 0;
+}
+
+/* 
+ * Called when the last user of an unregistered framebuffer goes away,
+ * which can be long after the device was unplugged.
+ */
+static void usbd480fb_destroy(struct fb_info *info)
+{
+	struct usbd480 *dev = info->par;
+
+	fb_dealloc_cmap(&info->cmap);
+	kfree(info->pseudo_palette);
+	vfree(dev->vmem);
+	framebuffer_release(info);
+	kref_put(&dev->kref, usbd480_delete);
+}
+
+static struct fb_ops usbd480fb_ops = {
+	.owner		= THIS_MODULE,
+	.fb_read	= fb_sys_read,
+	.fb_write	= usbd480fb_write,
+	.fb_setcolreg	= usbd480fb_setcolreg,
+	.fb_fillrect	= usbd480fb_fillrect,
+	.fb_copyarea	= usbd480fb_copyarea,
+	.fb_imageblit	= usbd480fb_imageblit,
+	.fb_open	= usbd480fb_open,
+	.fb_mmap	= usbd480fb_mmap,
+	.fb_destroy	= usbd480fb_destroy,
+	.fb_ioctl	= usbd480fb_ioctl,
+	.fb_pan_display = usbd480fb_pan_display,
+};
+
+/*
+ * Tuning profiles, made in configfs as usbd480fb/<name>. A profile
+ * applies to panels matching every match_ attribute it has set, the one
+ * with the most of them set wins. Profiles are looked at when a panel is
+ * probed, before anything is sent to it, so a panel already attached
+ * picks up changes when it is next bound. The character device takes
+ * pixels in the panel's own order and refuses to open on a rotated one.
+ */
+#define USBD480_MATCH_LEN 32
+
+struct usbd480_profile {
+	struct config_item item;
+	struct list_head list;
+	char match_serial[USBD480_MATCH_LEN];
+	char match_port[USBD480_MATCH_LEN];	/* USB device name, like 1-1.2 */
+	char match_name[USBD480_MATCH_LEN];
+	unsigned int refresh_ms;	/* 0 for refresh_delay */
+	unsigned int chunk;		/* bytes per bulk urb, 0 for the link's default */
+	int full_frames;		/* damage "full" instead of "rows" */
+	unsigned int rotate;		/* 0 or 180, the framebuffer and the splash */
+	int highpri;			/* priority "high" instead of "normal" */
+};
+
+static LIST_HEAD(usbd480_profiles);
+static DEFINE_MUTEX(usbd480_profiles_lock);
+
+static struct usbd480_profile *to_usbd480_profile(struct config_item *item)
+{
+	return container_of(item, struct usbd480_profile, item);
+}
+
+#define USBD480_PROFILE_STR(field)						\
+static ssize_t usbd480_profile_##field##_show(struct config_item *item, char *page) \
+{										\
+	struct usbd480_profile *p = to_usbd480_profile(item);			\
+	ssize_t len;								\
+										\
+	mutex_lock(&usbd480_profiles_lock);					\
+	len = sprintf(page, "%s\n", p->field);					\
+	mutex_unlock(&usbd480_profiles_lock);					\
+	return len;								\
+}										\
+										\
+static ssize_t usbd480_profile_##field##_store(struct config_item *item,	\
+		const char *page, size_t len)					\
+{										\
+	struct usbd480_profile *p = to_usbd480_profile(item);			\
+										\
+	if (len >= sizeof(p->field))						\
+		return -EINVAL;							\
+	mutex_lock(&usbd480_profiles_lock);					\
+	strscpy(p->field, page, sizeof(p->field));				\
+	strim(p->field);							\
+	mutex_unlock(&usbd480_profiles_lock);					\
+	return len;								\
+}										\
+CONFIGFS_ATTR(usbd480_profile_, field)
+
+#define USBD480_PROFILE_UINT(field, max)					\
+static ssize_t usbd480_profile_##field##_show(struct config_item *item, char *page) \
+{										\
+	return sprintf(page, "%u\n", to_usbd480_profile(item)->field);		\
+}										\
+										\
+static ssize_t usbd480_profile_##field##_store(struct config_item *item,	\
+		const char *page, size_t len)					\
+{										\
+	unsigned int val;							\
+	int ret;								\
+										\
+	ret = kstrtouint(page, 0, &val);					\
+	if (ret)								\
+		return ret;							\
+	if (val > (max))							\
+		return -EINVAL;							\
+	mutex_lock(&usbd480_profiles_lock);					\
+	to_usbd480_profile(item)->field = val;					\
+	mutex_unlock(&usbd480_profiles_lock);					\
+	return len;								\
+}										\
+CONFIGFS_ATTR(usbd480_profile_, field)
+
+USBD480_PROFILE_STR(match_serial);
+USBD480_PROFILE_STR(match_port);
+USBD480_PROFILE_STR(match_name);
+USBD480_PROFILE_UINT(refresh_ms, 1000);
+USBD480_PROFILE_UINT(chunk, USBD480_XFER_SIZE);
+
+static ssize_t usbd480_profile_rotate_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%u\n", to_usbd480_profile(item)->rotate);
+}
+
+static ssize_t usbd480_profile_rotate_store(struct config_item *item,
+		const char *page, size_t len)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(page, 0, &val);
+	if (ret)
+		return ret;
+	if (val != 0 && val != 180)
+		return -EINVAL;
+	mutex_lock(&usbd480_profiles_lock);
+	to_usbd480_profile(item)->rotate = val;
+	mutex_unlock(&usbd480_profiles_lock);
+	return len;
+}
+CONFIGFS_ATTR(usbd480_profile_, rotate);
+
+static ssize_t usbd480_profile_damage_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%s\n", to_usbd480_profile(item)->full_frames ? "full" : "rows");
+}
+
+static ssize_t usbd480_profile_damage_store(struct config_item *item,
+		const char *page, size_t len)
+{
+	int full;
+
+	if (sysfs_streq(page, "rows"))
+		full = 0;
+	else if (sysfs_streq(page, "full"))
+		full = 1;
+	else
+		return -EINVAL;
+	mutex_lock(&usbd480_profiles_lock);
+	to_usbd480_profile(item)->full_frames = full;
+	mutex_unlock(&usbd480_profiles_lock);
+	return len;
+}
+CONFIGFS_ATTR(usbd480_profile_, damage);
+
+static ssize_t usbd480_profile_priority_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%s\n", to_usbd480_profile(item)->highpri ? "high" : "normal");
+}
+
+static ssize_t usbd480_profile_priority_store(struct config_item *item,
+		const char *page, size_t len)
+{
+	int high;
+
+	if (sysfs_streq(page, "normal"))
+		high = 0;
+	else if (sysfs_streq(page, "high"))
+		high = 1;
+	else
+		return -EINVAL;
+	mutex_lock(&usbd480_profiles_lock);
+	to_usbd480_profile(item)->highpri = high;
+	mutex_unlock(&usbd480_profiles_lock);
+	return len;
+}
+CONFIGFS_ATTR(usbd480_profile_, priority);
+
+static struct configfs_attribute *usbd480_profile_attrs[] = {
+	&usbd480_profile_attr_match_serial,
+	&usbd480_profile_attr_match_port,
+	&usbd480_profile_attr_match_name,
+	&usbd480_profile_attr_refresh_ms,
+	&usbd480_profile_attr_chunk,
+	&usbd480_profile_attr_rotate,
+	&usbd480_profile_attr_damage,
+	&usbd480_profile_attr_priority,
+	NULL,
+};
+
+static void usbd480_profile_release(struct config_item *item)
+{
+	struct usbd480_profile *p = to_usbd480_profile(item);
+
+	mutex_lock(&usbd480_profiles_lock);
+	list_del(&p->list);
+	mutex_unlock(&usbd480_profiles_lock);
+	kfree(p);
+}
+
+static struct configfs_item_operations usbd480_profile_ops = {
+	.release =	usbd480_profile_release,
+};
+
+static const struct config_item_type usbd480_profile_type = {
+	.ct_item_ops =	&usbd480_profile_ops,
+	.ct_attrs =	usbd480_profile_attrs,
+	.ct_owner =	THIS_MODULE,
+};
+
+static struct config_item *usbd480_profile_make(struct config_group *group, const char *name)
+{
+	struct usbd480_profile *p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+
+	config_item_init_type_name(&p->item, name, &usbd480_profile_type);
+	mutex_lock(&usbd480_profiles_lock);
+	list_add_tail(&p->list, &usbd480_profiles);
+	mutex_unlock(&usbd480_profiles_lock);
+	return &p->item;
+}
+
+static struct configfs_group_operations usbd480_profiles_ops = {
+	.make_item =	usbd480_profile_make,
+};
+
+static const struct config_item_type usbd480_profiles_type = {
+	.ct_group_ops =	&usbd480_profiles_ops,
+	.ct_owner =	THIS_MODULE,
+};
+
+static struct configfs_subsystem usbd480_profiles_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf =	"usbd480fb",
+			.ci_type =	&usbd480_profiles_type,
+		},
+	},
+};
+
+/* number of match attributes set, 0 when one of them differs */
+static int usbd480_profile_match(struct usbd480_profile *p, struct usbd480 *d,
+		const char *port)
+{
+	int n = 0;
+
+	if (p->match_serial[0]) {
+		if (strcmp(p->match_serial, d->serial))
+			return 0;
+		n++;
+	}
+	if (p->match_port[0]) {
+		if (strcmp(p->match_port, port))
+			return 0;
+		n++;
+	}
+	if (p->match_name[0]) {
+		if (strcmp(p->match_name, d->device_name))
+			return 0;
+		n++;
+	}
+	return n;
+}
+
+static void usbd480_apply_profile(struct usbd480 *d)
+{
+	const char *port = d->udev ? dev_name(&d->udev->dev) : dev_name(d->dev);
+	struct usbd480_profile *p, *best = NULL;
+	int n, best_n = 0;
+
+	d->refresh = max(msecs_to_jiffies(refresh_delay), 1UL);
+
+	mutex_lock(&usbd480_profiles_lock);
+	list_for_each_entry(p, &usbd480_profiles, list) {
+		n = usbd480_profile_match(p, d, port);
+		if (n > best_n) {
+			best = p;
+			best_n = n;
+		}
+	}
+
+	if (best) {
+		if (best->refresh_ms)
+			d->refresh = max(msecs_to_jiffies(best->refresh_ms), 1UL);
+		/* whole packets, see usbd480_usb_send_bulk() */
+		if (best->chunk && d->udev)
+			d->chunk = max(rounddown(best->chunk, d->maxpacket), d->maxpacket);
+		d->full_frames = best->full_frames;
+		d->rotate = best->rotate == 180;
+		d->highpri = best->highpri;
+		strscpy(d->profile, config_item_name(&best->item), sizeof(d->profile));
+		dev_info(d->dev, "using profile %s\n", d->profile);
+	}
+	mutex_unlock(&usbd480_profiles_lock);
+}
+
+static int usbd480_profiles_init(void)
+{
+	config_group_init(&usbd480_profiles_subsys.su_group);
+	mutex_init(&usbd480_profiles_subsys.su_mutex);
+	return configfs_register_subsystem(&usbd480_profiles_subsys);
+}
+
+static void usbd480_profiles_exit(void)
+{
+	configfs_unregister_subsystem(&usbd480_profiles_subsys);
+}
+
+/*
+ * Everything common to real and fake panels once dev, tp and drvdata are
+ * set. On failure the caller drops the last reference.
+ */
+static int usbd480_setup(struct usbd480 *dev)
+{
+	int retval = -ENOMEM;
+	struct fb_info *info;
+
+	dev->probe_time = ktime_get();
+	dev->first_frame_ms = -1;
+	kref_init(&dev->kref);
+	mutex_init(&dev->mem_lock);
+	spin_lock_init(&dev->hist_lock);
+	init_usb_anchor(&dev->submitted);
+	spin_lock_init(&dev->job_lock);
+	INIT_LIST_HEAD(&dev->jobs);
+	INIT_WORK(&dev->job_work, usbd480_job_work);
+	INIT_KFIFO(dev->completions);
+	mutex_init(&dev->read_lock);
+	init_waitqueue_head(&dev->direct_wait);
+	init_waitqueue_head(&dev->pass_wait);
+	dev->hint_last = -1;
+	spin_lock_init(&dev->ops_lock);
+	dev->ops_last = -1;
+	dev->ops_full = 1;
+	dev->stale_last = -1;
+
+	retval = device_create_file(dev->dev, &dev_attr_brightness);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_width);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_height);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_name);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_first_frame_ms);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_selftest);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_firmware);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_caps);
+	if (retval)
+		goto error_dev_attr;
+	retval = device_create_file(dev->dev, &dev_attr_profile);
+	if (retval)
+		goto error_dev_attr;
+
+	dev->stats = (struct usbd480_stats *)get_zeroed_page(GFP_KERNEL);
+	if (!dev->stats) {
+		retval = -ENOMEM;
+		goto error_dev_attr;
+	}
+	dev->stats->version = USBD480_STATS_VERSION;
+	dev->rate_ns = ktime_get_ns();
+	retval = device_create_bin_file(dev->dev, &bin_attr_stats);
+	if (retval)
+		goto error_dev_attr;
+
+	dev_info(dev->dev, "USBD480 attached\n");
+	//printk(KERN_INFO "usbd480fb: USBD480 connected\n");
+
+	retval = usbd480_get_device_details(dev);
+	if (retval)
+		goto error_dev_attr;
+	dev->vmemsize = dev->width*dev->height*2;
+	dev->stats->width = dev->width;
+	dev->stats->height = dev->height;
+
+	usbd480_apply_profile(dev);
+	if (dev->rotate) {
+		dev->rotbuf = vmalloc(dev->vmemsize);
+		if (!dev->rotbuf) {
+			retval = -ENOMEM;
+			goto error_dev_attr;
+		}
+	}
+
+	retval = usbd480_alloc_heatmap(dev);
+	if (retval)
+		goto error_dev_attr;
+	dev->ops_first = dev->height * 2;
+	/* without it text is drawn by sys_imageblit() */
+	dev->glyphs = kcalloc(USBD480_GLYPH_PAIRS, sizeof(*dev->glyphs), GFP_KERNEL);
+	dev->vmem = NULL;
+
+	retval = usbd480_alloc_xfers(dev);
+	if (retval) {
+		dev_err(dev->dev, "Failed to allocate urbs\n");
+		goto error_dev_attr;
+	}
+
+	dev->wq = alloc_ordered_workqueue("usbd480fb/%s",
+		WQ_MEM_RECLAIM | (dev->highpri ? WQ_HIGHPRI : 0), dev_name(dev->dev));
+	if (!dev->wq) {
+		err("Could not create work queue\n");
+		retval = -ENOMEM;
+		goto error_dev_attr;
+	}
+	INIT_DELAYED_WORK(&dev->work, usbd480fb_work);
+
+	/* the splash needs a page of its own */
+	if (!splash || !*splash || !(dev->caps & USBD480_CAP_PAGES) ||
+	    dev->pages <= USBD480_SPLASH_PAGE || usbd480_show_splash(dev))
+		usbd480_clear(dev);
+
+	info = framebuffer_alloc(0, dev->dev);
+	if (!info)
+	{
+		printk("error: framebuffer_alloc\n");
+		retval = -ENOMEM;
+		goto error_fballoc;
+	}
+
+	info->screen_base = NULL;	/* set in usbd480fb_open() */
+	info->screen_size = dev->vmemsize * 2;
+	info->fbops = &usbd480fb_ops;
+
+	info->fix.type =	FB_TYPE_PACKED_PIXELS;
 	info->fix.visual =	FB_VISUAL_TRUECOLOR;
 	info->fix.xpanstep =	0;
-	info->fix.ypanstep =	0; /*1*/
+	info->fix.ypanstep =	1;
 	info->fix.ywrapstep =	0; 
 	info->fix.line_length = dev->width*16/8;
 	info->fix.accel =	FB_ACCEL_NONE;
 
-	info->fix.smem_start  = (unsigned long)dev->vmem_phys;
-	info->fix.smem_len = dev->vmemsize;
+	info->fix.smem_start  = 0;	/* vmalloc'd, see usbd480fb_mmap() */
+	info->fix.smem_len = dev->vmemsize * 2;
 
 	info->var.xres = 		dev->width;
 	info->var.yres = 		dev->height;
 	info->var.xres_virtual = 	dev->width;
-	info->var.yres_virtual = 	dev->height; /*8738*/
+	info->var.yres_virtual = 	dev->height * 2;	/* double buffered */
 	info->var.bits_per_pixel = 	16;
 	info->var.red.offset = 		11;	
 	info->var.red.length = 		5;
@@ -457,13 +4011,18 @@ static int usbd480_probe(struct usb_interface *interface, const struct usb_devic
       	info->var.vmode =		FB_VMODE_NONINTERLACED;
 
 	info->pseudo_palette = NULL;
-	info->par = NULL;
-	info->flags = FBINFO_FLAG_DEFAULT; /*FBINFO_HWACCEL_YPAN */
+	info->par = dev;
+	/*
+	 * The memory is plain vmalloc. Where fbcon still has SCROLL_MOVE
+	 * (FRAMEBUFFER_CONSOLE_LEGACY_ACCELERATION) this makes it move
+	 * the text with copyarea, otherwise it redraws every line.
+	 */
+	info->flags = FBINFO_READS_FAST;
 
 	info->pseudo_palette = kzalloc(sizeof(u32)*16, GFP_KERNEL);
 	if (info->pseudo_palette == NULL) {
 		retval = -ENOMEM;
-		dev_err(&interface->dev, "Failed to allocate pseudo_palette\n");
+		dev_err(dev->dev, "Failed to allocate pseudo_palette\n");
 		goto error_fbpseudopal;
 	}
 	
@@ -472,39 +4031,42 @@ static int usbd480_probe(struct usb_interface *interface, const struct usb_devic
 	retval = fb_alloc_cmap(&info->cmap, 256, 0);
 	if (retval < 0) {
 		retval = -ENOMEM;
-		dev_err(&interface->dev, "Failed to allocate cmap\n");
+		dev_err(dev->dev, "Failed to allocate cmap\n");
 		goto error_fballoccmap;	
 	}
 
-	//printk("phys=%lx p2v=%lx, v=%lx\n", dev->vmem_phys, phys_to_virt(dev->vmem_phys), dev->vmem);
-
 	retval = register_framebuffer(info);
 	if (retval < 0) {
 		printk("error: register_framebuffer \n");
 		goto error_fbreg;
 	}
 
+	dev->debugfs = debugfs_create_dir(dev_name(dev->dev), usbd480_debugfs_root);
+	debugfs_create_file("latency", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+			&usbd480_latency_fops);
+	debugfs_create_file("heatmap", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+			&usbd480_heatmap_fops);
+	if (dev->fake) {
+		debugfs_create_file("fake_stats", S_IRUGO | S_IWUSR, dev->debugfs, dev,
+				&usbd480_fake_stats_fops);
+		debugfs_create_file("fake_frame", S_IRUGO, dev->debugfs, dev,
+				&usbd480_fake_frame_fops);
+	}
+
+	/* the framebuffer holds a reference until usbd480fb_destroy() */
+	kref_get(&dev->kref);
 	dev->fbinfo = info;
 	dev->disp_page = 0;
 
-	dev->wq = create_singlethread_workqueue("usbd480fb"); //TODO: create unique names?
-	if (!dev->wq) {
-		err("Could not create work queue\n");
-		retval = -ENOMEM;
-		goto error_wq;
-	}
-
-	INIT_DELAYED_WORK(&dev->work, usbd480fb_work);
-	queue_delayed_work(dev->wq, &dev->work, USBD480_REFRESH_JIFFIES*4);
+	/* get a picture up right away, the panel shows garbage until then */
+	queue_delayed_work(dev->wq, &dev->work, 0);
 
 	printk(KERN_INFO
-	       "fb%d: USBD480 framebuffer device, using %ldK of memory\n",
-	       info->node, dev->vmemsize >> 10);
+	       "fb%d: USBD480 framebuffer device, %ldK of memory on first open\n",
+	       info->node, dev->vmemsize * 2 >> 10);
 
 	return 0;
 
-error_wq:
-	unregister_framebuffer(info);
 error_fbreg:
 	fb_dealloc_cmap(&info->cmap);
 error_fballoccmap:	
@@ -513,25 +4075,129 @@ error_fballoccmap:
 error_fbpseudopal:	
 	framebuffer_release(info);		
 error_fballoc:
-	size = PAGE_SIZE * (1 << USBD480_VIDEOMEMORDER);
-	addr = (unsigned long)dev->vmem;
-	while (size > 0) {
-	    ClearPageReserved(virt_to_page((void*)addr));
-	    addr += PAGE_SIZE;
-	    size -= PAGE_SIZE;
-	}
-	free_pages((unsigned long)dev->vmem, USBD480_VIDEOMEMORDER);
-error_vmem:
+	destroy_workqueue(dev->wq);
 error_dev_attr:
-	device_remove_file(&interface->dev, &dev_attr_brightness);
-	device_remove_file(&interface->dev, &dev_attr_width);
-	device_remove_file(&interface->dev, &dev_attr_height);
-	device_remove_file(&interface->dev, &dev_attr_name);
-error_dev:
-	usb_set_intfdata(interface, NULL);
-	if (dev)
-		kfree(dev);
+	device_remove_file(dev->dev, &dev_attr_brightness);
+	device_remove_file(dev->dev, &dev_attr_width);
+	device_remove_file(dev->dev, &dev_attr_height);
+	device_remove_file(dev->dev, &dev_attr_name);
+	device_remove_file(dev->dev, &dev_attr_first_frame_ms);
+	device_remove_file(dev->dev, &dev_attr_selftest);
+	device_remove_file(dev->dev, &dev_attr_firmware);
+	device_remove_file(dev->dev, &dev_attr_caps);
+	device_remove_file(dev->dev, &dev_attr_profile);
+	device_remove_bin_file(dev->dev, &bin_attr_stats);
+	return retval;
+}
+
+static void usbd480_teardown(struct usbd480 *dev)
+{
+	/* 
+	 * Refuse new submissions and kill whatever is on the wire, without
+	 * waiting for mem_lock, which the worker holds across a transfer.
+	 * It then finishes right away instead of running into timeouts.
+	 */
+	WRITE_ONCE(dev->gone, 1);
+	usb_poison_anchored_urbs(&dev->submitted);
+
+	/* job submitters check gone under job_lock before queueing */
+	spin_lock_irq(&dev->job_lock);
+	spin_unlock_irq(&dev->job_lock);
+	wake_up_interruptible(&dev->direct_wait);
+	wake_up_all(&dev->pass_wait);
+
+	/* waits for a self test in progress, which may requeue the worker */
+	device_remove_file(dev->dev, &dev_attr_brightness);
+	device_remove_file(dev->dev, &dev_attr_width);
+	device_remove_file(dev->dev, &dev_attr_height);
+	device_remove_file(dev->dev, &dev_attr_name);
+	device_remove_file(dev->dev, &dev_attr_first_frame_ms);
+	device_remove_file(dev->dev, &dev_attr_selftest);
+	device_remove_file(dev->dev, &dev_attr_firmware);
+	device_remove_file(dev->dev, &dev_attr_caps);
+	device_remove_file(dev->dev, &dev_attr_profile);
+	device_remove_bin_file(dev->dev, &bin_attr_stats);
+
+	cancel_delayed_work_sync(&dev->work);
+	destroy_workqueue(dev->wq);
+
+	debugfs_remove_recursive(dev->debugfs);
+
+	/* memory stays until the last open file is closed */
+	unregister_framebuffer(dev->fbinfo);
+}
+
+/*
+ * Bulk urbs are sized for the link. At high speed a 64K urb streams
+ * while the next one is filled. A full speed link moves about 1K per ms,
+ * so smaller urbs keep each one's timeout short and a failed one costs
+ * little.
+ */
+static void usbd480_usb_shape(struct usbd480 *dev, struct usb_endpoint_descriptor *out)
+{
+	unsigned int size;
+
+	dev->bulk_pipe = usb_sndbulkpipe(dev->udev, usb_endpoint_num(out));
+	dev->maxpacket = usb_endpoint_maxp(out);
+	if (dev->udev->speed >= USB_SPEED_HIGH)
+		size = USBD480_XFER_SIZE;
+	else
+		size = USBD480_XFER_SIZE_FS;
+	dev->chunk = rounddown(size, dev->maxpacket);
+}
+
+static int usbd480_probe(struct usb_interface *interface, const struct usb_device_id *id)
+{
+	struct usb_device *udev = interface_to_usbdev(interface);
+	struct usb_endpoint_descriptor *bulk_out;
+	struct usbd480 *dev = NULL;
+	int retval;
+
+	usb_find_common_endpoints(interface->cur_altsetting,
+			NULL, &bulk_out, NULL, NULL);
+	if (!bulk_out || !usb_endpoint_maxp(bulk_out)) {
+		dev_err(&interface->dev, "no usable bulk out endpoint\n");
+		return -ENODEV;
+	}
 
+	dev = kzalloc(sizeof(struct usbd480), GFP_KERNEL);
+	if (dev == NULL) {
+		dev_err(&interface->dev, "Out of memory\n");
+		return -ENOMEM;
+	}
+
+	dev->udev = usb_get_dev(udev);
+	dev->intf = interface;
+	dev->dev = &interface->dev;
+	dev->tp = &usbd480_usb_transport;
+	usbd480_usb_shape(dev, bulk_out);
+	usb_set_intfdata (interface, dev);
+
+	dev_dbg(&interface->dev, "bulk out ep%d, %u byte packets, %u byte urbs, %s speed\n",
+		usb_endpoint_num(bulk_out), dev->maxpacket, dev->chunk,
+		usb_speed_string(udev->speed));
+
+	retval = usbd480_setup(dev);
+	if (retval)
+		goto error_setup;
+
+	retval = usb_register_dev(interface, &usbd480_class);
+	if (retval) {
+		dev_err(&interface->dev, "Not able to get a minor for this device\n");
+		usbd480_teardown(dev);
+		goto error_setup;
+	}
+
+	if (autosuspend_delay >= 0) {
+		pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_delay);
+		usb_enable_autosuspend(udev);
+	}
+
+	return 0;
+
+error_setup:
+	usb_set_intfdata(interface, NULL);
+	kref_put(&dev->kref, usbd480_delete);
 	printk(KERN_INFO "usbd480fb: error probe\n");
 	return retval;
 }
@@ -539,65 +4205,287 @@ error_dev:
 static void usbd480_disconnect(struct usb_interface *interface)
 {
 	struct usbd480 *dev;
-	struct fb_info *info;
-	signed long size;
-	unsigned long addr;
 
 	dev = usb_get_intfdata (interface);
 
-	cancel_delayed_work_sync(&dev->work);
-	flush_workqueue(dev->wq);
-	destroy_workqueue(dev->wq);
-
-	//usb_deregister_dev(interface, &usbd480_class);
-
-	device_remove_file(&interface->dev, &dev_attr_brightness);
-	device_remove_file(&interface->dev, &dev_attr_width);
-	device_remove_file(&interface->dev, &dev_attr_height);
-	device_remove_file(&interface->dev, &dev_attr_name);
-
-	info = dev->fbinfo;
-	if (info) {
-		unregister_framebuffer(info);
-		framebuffer_release(info);
-		size = PAGE_SIZE * (1 << USBD480_VIDEOMEMORDER);
-		addr = (unsigned long)dev->vmem;
-		while (size > 0) {
-			ClearPageReserved(virt_to_page((void*)addr));
-			addr += PAGE_SIZE;
-			size -= PAGE_SIZE;
-		}
-		free_pages((unsigned long)dev->vmem, USBD480_VIDEOMEMORDER);
-	}
+	/* no new opens after this, open files keep their reference */
+	usb_deregister_dev(interface, &usbd480_class);
 
+	usbd480_teardown(dev);
 	usb_set_intfdata(interface, NULL);
-	usb_put_dev(dev->udev);
-	kfree(dev);
+
+	kref_put(&dev->kref, usbd480_delete);
 	dev_info(&interface->dev, "USBD480 disconnected\n");
 	
 //printk(KERN_INFO "usbd480fb: USBD480 disconnected\n");
 }
 
+static int usbd480_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct usbd480 *dev = usb_get_intfdata(interface);
+
+	/* 
+	 * On autosuspend the worker keeps polling for damage and resumes
+	 * the device itself, it never holds a transfer open at this point.
+	 */
+	if (PMSG_IS_AUTO(message))
+		return 0;
+
+	/*
+	 * Pans, damage reports and closes keep queueing the work, it returns
+	 * straight away from here on. Waiting for the frame or job in
+	 * progress leaves nothing in flight.
+	 */
+	mutex_lock(&dev->mem_lock);
+	dev->suspended = 1;
+	mutex_unlock(&dev->mem_lock);
+	cancel_delayed_work_sync(&dev->work);
+	flush_work(&dev->job_work);
+	return 0;
+}
+
+/*
+ * Bring the panel up to date before returning so it shows the right
+ * contents as soon as the system is back, then restart the refresh.
+ */
+static void usbd480_restore(struct usbd480 *dev)
+{
+	int first, last;
+
+	if (dev->brightness_set)
+		usbd480_set_brightness(dev, dev->brightness);
+
+	/* without a shadow the worker sorts things out on its first run */
+	mutex_lock(&dev->mem_lock);
+	usbd480_scroll_end(dev);
+	if (dev->direct)
+		usbd480_direct_resync(dev);
+	else if (!dev->shadow)
+		;
+	else if (usbd480_find_damage(dev, &first, &last) || dev->pages_stale) {
+		dev->shadow_valid = 1;
+		if (usbd480_send_frame(dev, first, last))
+			dev->pages_stale = 2;
+	}
+	else if (dev->caps & USBD480_CAP_PAGES)
+		usbd480_set_frame_start_address(dev,
+			dev->disp_page ? 0 : dev->vmemsize);
+	mutex_unlock(&dev->mem_lock);
+
+	dev->suspended = 0;
+	queue_delayed_work(dev->wq, &dev->work, dev->refresh);
+	queue_work(dev->wq, &dev->job_work);
+}
+
+static int usbd480_resume(struct usb_interface *interface)
+{
+	struct usbd480 *dev = usb_get_intfdata(interface);
+
+	/* device memory survived the suspend, only send what changed */
+	if (dev->suspended)
+		usbd480_restore(dev);
+	return 0;
+}
+
+static int usbd480_reset_resume(struct usb_interface *interface)
+{
+	struct usbd480 *dev = usb_get_intfdata(interface);
+
+	/* 
+	 * Device memory was lost in the reset. The next two frames go out
+	 * in full, one to each page, the first brings the picture back.
+	 * Partial updates to a page that wasn't refilled would show garbage.
+	 */
+	mutex_lock(&dev->mem_lock);
+	dev->pages_stale = 2;
+	mutex_unlock(&dev->mem_lock);
+
+	/* after an autosuspend the worker picks this up on its next update */
+	if (dev->suspended)
+		usbd480_restore(dev);
+	return 0;
+}
+
+static int usbd480_pre_reset(struct usb_interface *interface)
+{
+	struct usbd480 *dev = usb_get_intfdata(interface);
+
+	cancel_delayed_work_sync(&dev->work);
+	return 0;
+}
+
+static int usbd480_post_reset(struct usb_interface *interface)
+{
+	struct usbd480 *dev = usb_get_intfdata(interface);
+
+	/* full resync, the reset cleared device memory */
+	dev->pages_stale = 2;
+	dev->retries = 0;
+	if (dev->brightness_set)
+		usbd480_set_brightness(dev, dev->brightness);
+	if (!dev->suspended)
+		queue_delayed_work(dev->wq, &dev->work, 0);
+	return 0;
+}
+
 static struct usb_driver usbd480_driver = {
 	.name =		"usbd480fb",
 	.probe =	usbd480_probe,
 	.disconnect =	usbd480_disconnect,
+	.suspend =	usbd480_suspend,
+	.resume =	usbd480_resume,
+	.reset_resume =	usbd480_reset_resume,
+	.pre_reset =	usbd480_pre_reset,
+	.post_reset =	usbd480_post_reset,
 	.id_table =	id_table,
+	.supports_autosuspend = 1,
+	/* probe talks to the device, don't hold up enumeration of others */
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+};
+
+/*
+ * Simulated panels, created with the fake_panels parameter. They go
+ * through the same setup, worker and framebuffer as a real device, only
+ * the transport differs and there is no runtime pm or port reset.
+ */
+static struct platform_device *usbd480_fake_devs[USBD480_FAKE_MAX];
+
+static int usbd480_fake_probe(struct platform_device *pdev)
+{
+	struct usbd480 *dev;
+	int retval;
+
+	dev = kzalloc(sizeof(struct usbd480), GFP_KERNEL);
+	if (dev == NULL)
+		return -ENOMEM;
+
+	dev->fake = kzalloc(sizeof(struct usbd480_fake), GFP_KERNEL);
+	if (dev->fake == NULL) {
+		kfree(dev);
+		return -ENOMEM;
+	}
+	mutex_init(&dev->fake->lock);
+
+	dev->dev = &pdev->dev;
+	dev->tp = &usbd480_fake_transport;
+	platform_set_drvdata(pdev, dev);
+
+	retval = usbd480_setup(dev);
+	if (retval)
+		goto error_setup;
+
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = dev_name(&pdev->dev);
+	dev->misc.fops = &usbd480_fake_fops;
+	dev->misc.parent = &pdev->dev;
+	retval = misc_register(&dev->misc);
+	if (retval) {
+		usbd480_teardown(dev);
+		goto error_setup;
+	}
+	return 0;
+
+error_setup:
+	platform_set_drvdata(pdev, NULL);
+	kref_put(&dev->kref, usbd480_delete);
+	return retval;
+}
+
+static void usbd480_fake_remove(struct platform_device *pdev)
+{
+	struct usbd480 *dev = platform_get_drvdata(pdev);
+
+	misc_deregister(&dev->misc);
+	usbd480_teardown(dev);
+	platform_set_drvdata(pdev, NULL);
+	kref_put(&dev->kref, usbd480_delete);
+}
+
+static struct platform_driver usbd480_fake_driver = {
+	.probe =	usbd480_fake_probe,
+	.remove =	usbd480_fake_remove,
+	.driver = {
+		.name =	"usbd480fb-fake",
+	},
 };
 
+static void usbd480_fake_exit(void)
+{
+	int i;
+
+	if (fake_panels <= 0)
+		return;
+
+	for (i = 0; i < USBD480_FAKE_MAX; i++) {
+		if (usbd480_fake_devs[i])
+			platform_device_unregister(usbd480_fake_devs[i]);
+		usbd480_fake_devs[i] = NULL;
+	}
+	platform_driver_unregister(&usbd480_fake_driver);
+}
+
+static int usbd480_fake_init(void)
+{
+	int retval;
+	int i;
+
+	if (fake_panels <= 0)
+		return 0;
+
+	retval = platform_driver_register(&usbd480_fake_driver);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < min(fake_panels, USBD480_FAKE_MAX); i++) {
+		struct platform_device *pdev;
+
+		pdev = platform_device_register_simple("usbd480fb-fake", i, NULL, 0);
+		if (IS_ERR(pdev)) {
+			retval = PTR_ERR(pdev);
+			usbd480_fake_exit();
+			return retval;
+		}
+		usbd480_fake_devs[i] = pdev;
+	}
+	return 0;
+}
+
 static int __init usbd480_init(void)
 {
 	int retval = 0;
 
+	usbd480_debugfs_root = debugfs_create_dir("usbd480fb", NULL);
+
+	/* profiles have to be there before the first probe */
+	retval = usbd480_profiles_init();
+	if (retval) {
+		debugfs_remove_recursive(usbd480_debugfs_root);
+		return retval;
+	}
+
 	retval = usb_register(&usbd480_driver);
-	if (retval)
+	if (retval) {
 		err("usb_register failed. Error number %d", retval);
+		usbd480_profiles_exit();
+		debugfs_remove_recursive(usbd480_debugfs_root);
+		return retval;
+	}
+
+	retval = usbd480_fake_init();
+	if (retval) {
+		usb_deregister(&usbd480_driver);
+		usbd480_profiles_exit();
+		debugfs_remove_recursive(usbd480_debugfs_root);
+	}
 	return retval;
 }
 
 static void __exit usbd480_exit(void)
 {
+	usbd480_fake_exit();
 	usb_deregister(&usbd480_driver);
+	usbd480_profiles_exit();
+	debugfs_remove_recursive(usbd480_debugfs_root);
 }
 
 module_init (usbd480_init);
@@ -606,3 +4494,7 @@ module_exit (usbd480_exit);
 MODULE_AUTHOR("Henri Skippari");
 MODULE_DESCRIPTION("USBD480 framebuffer driver");
 MODULE_LICENSE("GPL");
+
+#if IS_ENABLED(CONFIG_FB_USBD480_KUNIT_TEST)
+#include "usbd480fb_test.c"
+#endif
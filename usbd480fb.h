@@ -0,0 +1,147 @@
+/*
+ * USBD480 USB display framebuffer driver, interface to userspace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _USBD480FB_H
+#define _USBD480FB_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Statistics page, the "stats" binary attribute of the USB interface in
+ * sysfs. It can be read or mapped read-only. seq is odd while the driver
+ * updates the page, a consistent copy is one taken between two reads of
+ * the same even seq. Times are CLOCK_MONOTONIC. The framebuffer frame
+ * shown at last_flip_ns holds everything drawn before last_scan_ns.
+ */
+#define USBD480_STATS_VERSION 2
+
+struct usbd480_stats {
+	__u32 seq;
+	__u32 version;
+	__u32 width;
+	__u32 height;
+	__u64 frames;		/* frames shown */
+	__u64 bytes;		/* frame data sent */
+	__u64 bytes_saved;	/* full frames minus what was sent for them */
+	__u64 skipped;		/* refreshes without damage */
+	__u64 dropped;		/* frames that failed to send */
+	__u64 errors;		/* failed device operations */
+	__u64 busy_ns;		/* time spent sending frames */
+	__u64 last_flip_ns;	/* when the last frame was shown */
+	__u32 fps_x100;		/* frames per second over the last second, x100 */
+	__u32 bytes_per_sec;	/* over the last second */
+	__u32 latency_p50_us;	/* damage seen to frame shown */
+	__u32 latency_p99_us;
+	__u32 latency_max_us;
+	__u32 pad;
+	__u64 last_scan_ns;	/* when the damage scan for that frame started */
+};
+
+/*
+ * Damage heatmap, debugfs usbd480fb/<interface>/heatmap. The header is
+ * followed by tiles_x * tiles_y counts of how often each tile changed,
+ * then as many counts of how often it was sent, both as __u32 row by row.
+ * Writing to the file resets the counts.
+ */
+struct usbd480_heatmap {
+	__u32 tile_size;	/* pixels, tiles are square */
+	__u32 tiles_x;
+	__u32 tiles_y;
+	__u32 frames;		/* frames with damage counted */
+};
+
+/*
+ * Character device /dev/usbd480-N, drives the panel directly without the
+ * framebuffer. While it is open the framebuffer is not polled. The driver
+ * keeps an image of device pages 0 and 1. A write() or writev() carries
+ * a batch of commands, each a struct usbd480_cmd followed by its payload
+ * padded to 4 bytes. Blits only update the page images; the changed rows
+ * are sent at the next flip, fence or the end of the batch, merged into
+ * as few transfers as possible. A blocking write returns once that is done.
+ * Coordinates are the panel's own, so opening fails with EOPNOTSUPP on a
+ * panel whose profile rotates it.
+ */
+#define USBD480_CMD_BLIT	1	/* w*h RGB565 pixels from the payload to page at x,y */
+#define USBD480_CMD_FLIP	2	/* show page */
+#define USBD480_CMD_BRIGHTNESS	3	/* value 0-255 */
+#define USBD480_CMD_FENCE	4	/* send everything before, value is an id */
+
+#define USBD480_DIRECT_PAGES	2
+
+struct usbd480_cmd {
+	__u16 op;
+	__u16 page;
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+	__u32 value;
+};
+
+struct usbd480_details {
+	char name[20];
+	__u32 width;
+	__u32 height;
+};
+
+/*
+ * Zero copy submission on the character device. The rectangle is sent
+ * from the caller's memory, which must stay untouched until the
+ * completion with the same id can be read from the device. poll() reports
+ * POLLIN while completions are waiting, and the eventfd, if not -1, is
+ * signalled for each. At most 8 submissions can be in flight, more fail
+ * with EAGAIN. Jobs and writes run in submission order.
+ *
+ * Writes to a file opened with O_NONBLOCK, also when submitted through
+ * io_uring, queue the batch as a job in the same slots and return at
+ * once. Their completion carries the value of the batch's last
+ * USBD480_CMD_FENCE, or 0. poll() reports POLLOUT while a slot is free.
+ * Other writes return once the batch is on the device.
+ */
+#define USBD480_USERPTR_FLIP	1	/* show the page once the rectangle is sent */
+
+struct usbd480_userptr {
+	__u64 addr;		/* first pixel of the rectangle */
+	__u32 pitch;		/* bytes between rows at addr */
+	__u32 id;		/* returned in the completion */
+	__u16 page;
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+	__u16 flags;
+	__s32 eventfd;
+};
+
+struct usbd480_completion {
+	__u32 id;
+	__s32 status;		/* 0 or a negative errno */
+};
+
+#define IOCTL_SET_BRIGHTNESS 0x10	/* arg is the brightness */
+#define IOCTL_GET_DEVICE_DETAILS 0x20	/* arg points to struct usbd480_details */
+#define IOCTL_SUBMIT_USERPTR _IOW('U', 0x30, struct usbd480_userptr)
+
+/*
+ * Framebuffer /dev/fbN. Its memory holds two frames, yres_virtual is
+ * twice yres: draw into the hidden one and FBIOPAN_DISPLAY to it. The
+ * panned to frame is sent right away. FBIO_WAITFORVSYNC returns once
+ * everything drawn before the call is on the panel. IOCTL_DAMAGE reports
+ * rows drawn in the shown frame and sends them without waiting for the
+ * next refresh; other rows changed meanwhile follow at the next one.
+ */
+struct usbd480_damage {
+	__u32 y;
+	__u32 h;
+};
+
+#define IOCTL_DAMAGE _IOW('U', 0x31, struct usbd480_damage)
+
+#endif /* _USBD480FB_H */
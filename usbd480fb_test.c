@@ -0,0 +1,328 @@
+/*
+ * USBD480 USB display framebuffer driver KUnit tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Included at the end of usbd480fb.c. Each case sets up a fake panel the
+ * way the fake_panels parameter does and drives the worker one pass at a
+ * time. After every pass the page the fake device shows has to match the
+ * framebuffer, and the bytes and simulated wire time of the workload are
+ * logged.
+ */
+
+#include <kunit/test.h>
+#include <linux/random.h>
+
+struct usbd480_kunit {
+	struct platform_device *pdev;
+	struct usbd480 *d;
+	int realtime;
+};
+
+static int usbd480_kunit_init(struct kunit *test)
+{
+	struct usbd480_kunit *t;
+	struct usbd480 *d;
+	int retval;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+	test->priv = t;
+
+	/* count the wire time, don't wait for it */
+	t->realtime = fake_realtime;
+	fake_realtime = 0;
+
+	t->pdev = platform_device_register_simple("usbd480fb-test",
+		PLATFORM_DEVID_AUTO, NULL, 0);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(t->pdev));
+
+	retval = usbd480_fake_probe(t->pdev);
+	if (retval) {
+		platform_device_unregister(t->pdev);
+		KUNIT_ASSERT_EQ(test, retval, 0);
+	}
+	d = platform_get_drvdata(t->pdev);
+	t->d = d;
+
+	/* the passes below are the only ones */
+	d->refresh = 3600 * HZ;
+	mod_delayed_work(d->wq, &d->work, d->refresh);
+
+	KUNIT_ASSERT_EQ(test, usbd480fb_open(d->fbinfo, 1), 0);
+	/* as if a client had it mapped, every row is compared */
+	atomic_inc(&d->mapped);
+	return 0;
+}
+
+static void usbd480_kunit_exit(struct kunit *test)
+{
+	struct usbd480_kunit *t = test->priv;
+
+	atomic_dec(&t->d->mapped);
+	usbd480_fake_remove(t->pdev);
+	platform_device_unregister(t->pdev);
+	fake_realtime = t->realtime;
+}
+
+static void usbd480_kunit_pass(struct usbd480 *d)
+{
+	mod_delayed_work(d->wq, &d->work, 0);
+	flush_delayed_work(&d->work);
+}
+
+static void usbd480_kunit_counters_clear(struct usbd480 *d)
+{
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	f->commands = 0;
+	f->bytes = 0;
+	f->wire_ns = 0;
+	f->flips = 0;
+	f->halts = 0;
+	f->resets = 0;
+	mutex_unlock(&f->lock);
+}
+
+/* until both pages hold the frame and nothing is left to send */
+static void usbd480_kunit_settle(struct usbd480 *d)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		usbd480_kunit_pass(d);
+	usbd480_kunit_counters_clear(d);
+}
+
+static void usbd480_kunit_check(struct kunit *test, struct usbd480 *d)
+{
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	KUNIT_EXPECT_EQ(test, f->mismatches, 0ULL);
+	KUNIT_EXPECT_EQ(test, memcmp(f->mem + (unsigned long)f->frame_start * 2,
+		usbd480_front(d), d->vmemsize), 0);
+	mutex_unlock(&f->lock);
+}
+
+static u64 usbd480_kunit_bytes(struct usbd480 *d)
+{
+	u64 bytes;
+
+	mutex_lock(&d->fake->lock);
+	bytes = d->fake->bytes;
+	mutex_unlock(&d->fake->lock);
+	return bytes;
+}
+
+static void usbd480_kunit_report(struct kunit *test, struct usbd480 *d,
+		const char *workload)
+{
+	struct usbd480_fake *f = d->fake;
+
+	mutex_lock(&f->lock);
+	kunit_info(test, "%s: %llu bytes, %llu commands, %llu flips, %llu us on the wire\n",
+		workload, f->bytes, f->commands, f->flips,
+		div_u64(f->wire_ns, NSEC_PER_USEC));
+	mutex_unlock(&f->lock);
+}
+
+static void usbd480_kunit_full(struct kunit *test)
+{
+	struct usbd480 *d = ((struct usbd480_kunit *)test->priv)->d;
+	int i;
+
+	usbd480_kunit_settle(d);
+	usbd480_kunit_check(test, d);
+
+	for (i = 0; i < 4; i++) {
+		get_random_bytes(d->vmem, d->vmemsize);
+		usbd480_kunit_pass(d);
+		usbd480_kunit_check(test, d);
+	}
+	KUNIT_EXPECT_EQ(test, usbd480_kunit_bytes(d), 4ULL * d->vmemsize);
+
+	/* nothing changed, nothing sent */
+	usbd480_kunit_pass(d);
+	KUNIT_EXPECT_EQ(test, usbd480_kunit_bytes(d), 4ULL * d->vmemsize);
+	usbd480_kunit_report(test, d, "full frames");
+}
+
+static void usbd480_kunit_partial(struct kunit *test)
+{
+	struct usbd480 *d = ((struct usbd480_kunit *)test->priv)->d;
+	unsigned int pitch = d->width * 2;
+	int y;
+
+	usbd480_kunit_settle(d);
+
+	/* the back page misses nothing yet, only the changed rows go */
+	get_random_bytes(d->vmem + 10 * pitch, 10 * pitch);
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	KUNIT_EXPECT_EQ(test, usbd480_kunit_bytes(d), 10ULL * pitch);
+
+	/* a blinking cursor, one row at a time at the same place */
+	for (y = 0; y < 8; y++) {
+		d->vmem[(100 + y) * pitch] ^= 0xff;
+		usbd480_kunit_pass(d);
+		usbd480_kunit_check(test, d);
+	}
+	KUNIT_EXPECT_LT(test, usbd480_kunit_bytes(d), (u64)d->vmemsize);
+	usbd480_kunit_report(test, d, "partial updates");
+}
+
+static void usbd480_kunit_scroll(struct kunit *test)
+{
+	struct usbd480 *d = ((struct usbd480_kunit *)test->priv)->d;
+	struct fb_info *info = d->fbinfo;
+	unsigned int pitch = d->width * 2;
+	struct fb_copyarea area = {
+		.sx = 0, .sy = 16, .dx = 0, .dy = 0,
+		.width = info->var.xres, .height = info->var.yres - 16,
+	};
+	int moved = 0;
+	u64 bytes;
+
+	get_random_bytes(d->vmem, d->vmemsize);
+	usbd480_kunit_settle(d);
+
+	/* text scrolling up a line of 16 rows at a time */
+	while (moved <= d->height) {
+		bytes = usbd480_kunit_bytes(d);
+		usbd480fb_copyarea(info, &area);
+		get_random_bytes(d->vmem + (d->height - 16) * pitch, 16 * pitch);
+		usbd480_kunit_pass(d);
+		usbd480_kunit_check(test, d);
+		moved += 16;
+
+		/* the frame start moves, only the new line is sent */
+		if (moved + d->height <= d->vmemsize / d->width) {
+			KUNIT_EXPECT_TRUE(test, d->scrolling);
+			KUNIT_EXPECT_EQ(test, usbd480_kunit_bytes(d) - bytes, 16ULL * pitch);
+		}
+	}
+
+	/* past the free frame after the page, back to flipping */
+	KUNIT_EXPECT_FALSE(test, d->scrolling);
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	usbd480_kunit_report(test, d, "scrolling");
+}
+
+/* the way fbcon moves text, a copyarea per line and run of characters */
+static void usbd480_kunit_scroll_lines(struct kunit *test)
+{
+	struct usbd480 *d = ((struct usbd480_kunit *)test->priv)->d;
+	struct fb_info *info = d->fbinfo;
+	unsigned int pitch = d->width * 2;
+	unsigned int half = info->var.xres / 2;
+	struct fb_copyarea area = { .height = 16 };
+	u64 bytes;
+	int i, y;
+
+	get_random_bytes(d->vmem, d->vmemsize);
+	usbd480_kunit_settle(d);
+
+	for (i = 0; i < 3; i++) {
+		bytes = usbd480_kunit_bytes(d);
+		for (y = 16; y + 16 <= d->height; y += 16) {
+			area.sy = y;
+			area.dy = y - 16;
+			area.sx = area.dx = 0;
+			area.width = half;
+			usbd480fb_copyarea(info, &area);
+			area.sx = area.dx = half;
+			area.width = info->var.xres - half;
+			usbd480fb_copyarea(info, &area);
+		}
+		get_random_bytes(d->vmem + (d->height - 16) * pitch, 16 * pitch);
+		usbd480_kunit_pass(d);
+		usbd480_kunit_check(test, d);
+
+		/* rows below the last whole line were not moved */
+		KUNIT_EXPECT_TRUE(test, d->scrolling);
+		KUNIT_EXPECT_LE(test, usbd480_kunit_bytes(d) - bytes,
+			(u64)(16 + d->height % 16) * pitch);
+	}
+
+	/* two lines of text added before the worker got to it */
+	bytes = usbd480_kunit_bytes(d);
+	for (i = 0; i < 2; i++) {
+		for (y = 16; y + 16 <= d->height; y += 16) {
+			area.sy = y;
+			area.dy = y - 16;
+			area.sx = area.dx = 0;
+			area.width = info->var.xres;
+			usbd480fb_copyarea(info, &area);
+		}
+		get_random_bytes(d->vmem + (d->height - 16) * pitch, 16 * pitch);
+	}
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	KUNIT_EXPECT_LE(test, usbd480_kunit_bytes(d) - bytes,
+		(u64)(32 + d->height % 16) * pitch);
+	usbd480_kunit_report(test, d, "scrolling by lines");
+}
+
+static void usbd480_kunit_errors(struct kunit *test)
+{
+	struct usbd480 *d = ((struct usbd480_kunit *)test->priv)->d;
+	struct usbd480_fake *f = d->fake;
+	int i;
+
+	usbd480_kunit_settle(d);
+
+	/* a stall is cleared through the transport, the retry sends it all */
+	mutex_lock(&f->lock);
+	f->fail_writes = 1;
+	f->fail_error = -EPIPE;
+	mutex_unlock(&f->lock);
+	get_random_bytes(d->vmem, d->vmemsize / 2);
+	usbd480_kunit_pass(d);
+	KUNIT_EXPECT_EQ(test, f->halts, 1ULL);
+	KUNIT_EXPECT_EQ(test, d->retries, 1);
+	KUNIT_EXPECT_EQ(test, d->pages_stale, 2);
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	KUNIT_EXPECT_EQ(test, d->retries, 0);
+
+	/* enough timeouts in a row reset the device, which loses its memory */
+	mutex_lock(&f->lock);
+	f->fail_writes = USBD480_MAX_RETRIES;
+	f->fail_error = -ETIMEDOUT;
+	mutex_unlock(&f->lock);
+	get_random_bytes(d->vmem, d->vmemsize);
+	for (i = 0; i < USBD480_MAX_RETRIES; i++)
+		usbd480_kunit_pass(d);
+	KUNIT_EXPECT_EQ(test, f->resets, 1ULL);
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	usbd480_kunit_pass(d);
+	usbd480_kunit_check(test, d);
+	usbd480_kunit_report(test, d, "errors");
+}
+
+static struct kunit_case usbd480_kunit_cases[] = {
+	KUNIT_CASE(usbd480_kunit_full),
+	KUNIT_CASE(usbd480_kunit_partial),
+	KUNIT_CASE(usbd480_kunit_scroll),
+	KUNIT_CASE(usbd480_kunit_scroll_lines),
+	KUNIT_CASE(usbd480_kunit_errors),
+	{}
+};
+
+static struct kunit_suite usbd480_kunit_suite = {
+	.name = "usbd480fb",
+	.init = usbd480_kunit_init,
+	.exit = usbd480_kunit_exit,
+	.test_cases = usbd480_kunit_cases,
+};
+
+kunit_test_suite(usbd480_kunit_suite);
@@ -0,0 +1,150 @@
+/*
+ * USBD480 USB display framebuffer driver tracepoints
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbd480fb
+
+#if !defined(_USBD480FB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USBD480FB_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+/* changed rows found in the framebuffer */
+TRACE_EVENT(usbd480_damage,
+	TP_PROTO(struct device *dev, int first, int last, int rows),
+	TP_ARGS(dev, first, last, rows),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, first)
+		__field(int, last)
+		__field(int, rows)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->first = first;
+		__entry->last = last;
+		__entry->rows = rows;
+	),
+	TP_printk("dev=%s rows=%d-%d changed=%d",
+		__get_str(dev), __entry->first, __entry->last, __entry->rows)
+);
+
+/* what is about to be sent for a frame */
+TRACE_EVENT(usbd480_frame_plan,
+	TP_PROTO(struct device *dev, unsigned int page, int first, int last,
+		unsigned int bytes, unsigned int regions, u64 damage_ns),
+	TP_ARGS(dev, page, first, last, bytes, regions, damage_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, page)
+		__field(int, first)
+		__field(int, last)
+		__field(unsigned int, bytes)
+		__field(unsigned int, regions)
+		__field(u64, damage_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->page = page;
+		__entry->first = first;
+		__entry->last = last;
+		__entry->bytes = bytes;
+		__entry->regions = regions;
+		__entry->damage_ns = damage_ns;
+	),
+	TP_printk("dev=%s page=%u rows=%d-%d bytes=%u regions=%u damage_ns=%llu",
+		__get_str(dev), __entry->page, __entry->first, __entry->last,
+		__entry->bytes, __entry->regions, __entry->damage_ns)
+);
+
+DECLARE_EVENT_CLASS(usbd480_urb,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&urb->dev->dev))
+		__field(void *, urb)
+		__field(unsigned int, ep)
+		__field(unsigned int, bytes)
+		__field(unsigned int, actual)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->urb = urb;
+		__entry->ep = usb_pipeendpoint(urb->pipe);
+		__entry->bytes = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->status = urb->status;
+	),
+	TP_printk("dev=%s urb=%p ep=%u bytes=%u actual=%u status=%d",
+		__get_str(dev), __entry->urb, __entry->ep, __entry->bytes,
+		__entry->actual, __entry->status)
+);
+
+DEFINE_EVENT(usbd480_urb, usbd480_urb_submit,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb)
+);
+
+DEFINE_EVENT(usbd480_urb, usbd480_urb_complete,
+	TP_PROTO(struct urb *urb),
+	TP_ARGS(urb)
+);
+
+/* a frame is on screen, latency_ns counts from when its damage was seen */
+TRACE_EVENT(usbd480_frame_flip,
+	TP_PROTO(struct device *dev, unsigned int page, unsigned int bytes,
+		u64 latency_ns),
+	TP_ARGS(dev, page, bytes, latency_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, page)
+		__field(unsigned int, bytes)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->page = page;
+		__entry->bytes = bytes;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("dev=%s page=%u bytes=%u latency_ns=%llu",
+		__get_str(dev), __entry->page, __entry->bytes, __entry->latency_ns)
+);
+
+/* a frame did not make it to the screen */
+TRACE_EVENT(usbd480_frame_drop,
+	TP_PROTO(struct device *dev, unsigned int page, unsigned int bytes,
+		int error),
+	TP_ARGS(dev, page, bytes, error),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, page)
+		__field(unsigned int, bytes)
+		__field(int, error)
+	),
+	TP_fast_assign(
+		__assign_str(dev);
+		__entry->page = page;
+		__entry->bytes = bytes;
+		__entry->error = error;
+	),
+	TP_printk("dev=%s page=%u bytes=%u error=%d",
+		__get_str(dev), __entry->page, __entry->bytes, __entry->error)
+);
+
+#endif /* _USBD480FB_TRACE_H */
+
+/* out of tree, the header sits next to the driver */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbd480fb_trace
+#include <trace/define_trace.h>